@@ -2,18 +2,43 @@
 #define ASYNC_FUNCS_HPP
 
 #include <condition_variable>
+#include <algorithm>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <atomic>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <memory>
 #include <list>
 
 namespace external_sort {
 namespace aux {
 
+// Runs a batch of tasks in parallel and returns when all of them are done
+class TaskRunner
+{
+  public:
+    using Task = std::function<void()>;
+    virtual ~TaskRunner() = default;
+    virtual void RunAll(std::vector<Task>& tasks) = 0;
+};
+
+// Runs functions asynchronously on a fixed pool of worker threads.
+// Functions are queued and picked up by the workers in order;
+// their results are collected with GetAny as they get ready.
+// The workers also run the tasks of RunAll (ahead of the functions):
+// the caller of RunAll runs them as well while it waits, so a function
+// running on a worker may split its work into tasks on the same workers.
 template <typename ResultType>
-class AsyncFuncs
+class AsyncFuncs : public TaskRunner
 {
   public:
+    // workers = 0 means as many workers as hardware threads
+    explicit AsyncFuncs(size_t workers = 0);
+    ~AsyncFuncs();
+
     template <class Fn, class... Args>
     void Async(Fn&& fn, Args&&... args);
     ResultType GetAny();
@@ -21,22 +46,57 @@ class AsyncFuncs
     bool Empty() const { return All() == 0; }
     size_t All() const { return Ready() + Running(); }
     size_t Ready() const;
-    size_t Running() const;
+    size_t Running() const;             // queued or running
+    size_t Workers() const { return workers_.size(); }
+
+    void RunAll(std::vector<Task>& tasks) override;
 
   private:
-    template <class Fn, class... Args>
-    void RunFunc(Fn&& fn, Args&&... args);
+    void WorkerLoop();
 
   private:
     TRACEX_NAME("AsyncFuncs");
 
     mutable std::mutex mtx_;
-    std::condition_variable cv_;
+    std::condition_variable cv_;        // notifies about ready results
+    std::condition_variable cv_queue_;  // notifies about queued functions
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<ResultType()>> funcs_queue_;
+    std::deque<Task> tasks_queue_;
+    std::condition_variable cv_tasks_;  // notifies about queued/finished tasks
+    bool stopped_ = {false};
 
     std::atomic<size_t> funcs_running_ = {0};
     std::list<ResultType> funcs_ready_;
 };
 
+template <typename ResultType>
+AsyncFuncs<ResultType>::AsyncFuncs(size_t workers)
+{
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    TRACEX(("starting %d workers") % workers);
+    for (size_t i = 0; i < workers; i++) {
+        workers_.emplace_back(&AsyncFuncs::WorkerLoop, this);
+    }
+}
+
+template <typename ResultType>
+AsyncFuncs<ResultType>::~AsyncFuncs()
+{
+    // let the workers finish the queued functions and quit
+    {
+        std::unique_lock<std::mutex> lck(mtx_);
+        stopped_ = true;
+        cv_queue_.notify_all();
+    }
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
 template <typename ResultType>
 size_t AsyncFuncs<ResultType>::Running() const
 {
@@ -70,31 +130,144 @@ template <typename ResultType>
 template <class Fn, class... Args>
 void AsyncFuncs<ResultType>::Async(Fn&& fn, Args&&... args)
 {
+    // arguments are bound to the function by value (decayed)
+    std::function<ResultType()> func =
+        std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...);
+
     std::unique_lock<std::mutex> lck(mtx_);
     funcs_running_++;
-    TRACEX(("async func starting (%d/%d)")
+    funcs_queue_.push(std::move(func));
+    TRACEX(("async func queued (%d/%d)")
            % funcs_running_ % funcs_ready_.size());
-    std::thread task(&AsyncFuncs::RunFunc<Fn, Args...>, this,
-                     std::forward<Fn>(fn), std::forward<Args>(args)...);
-    task.detach();
+    cv_queue_.notify_one();
 }
 
 template <typename ResultType>
-template <class Fn, class... Args>
-void AsyncFuncs<ResultType>::RunFunc(Fn&& fn, Args&&... args)
+void AsyncFuncs<ResultType>::RunAll(std::vector<Task>& tasks)
 {
-    TRACEX(("async func started (%d/%d)")
-           % funcs_running_ % funcs_ready_.size());
-    ResultType result = fn(std::forward<Args>(args)...);
+    if (tasks.empty()) {
+        return;
+    }
 
+    // queue all the tasks but the first one, which is run right here
+    auto left = std::make_shared<size_t>(tasks.size());  // guarded by mtx_
     std::unique_lock<std::mutex> lck(mtx_);
-    funcs_ready_.push_back(result);
-    funcs_running_--;
-    TRACEX(("async func ready (%d/%d)")
-           % funcs_running_ % funcs_ready_.size());
+    for (size_t i = 1; i < tasks.size(); i++) {
+        Task task = std::move(tasks[i]);
+        tasks_queue_.push_back([this, task, left] () {
+            task();
+            std::unique_lock<std::mutex> lck(mtx_);
+            if (--*left == 0) {
+                cv_tasks_.notify_all();
+            }
+        });
+        cv_queue_.notify_one();
+    }
+    cv_tasks_.notify_all();             // (for the callers waiting to help)
+    lck.unlock();
+    tasks[0]();
+    lck.lock();
+    --*left;
+
+    // help with the queued tasks (of any batch) until the batch is done
+    while (*left) {
+        if (tasks_queue_.empty()) {
+            cv_tasks_.wait(lck);
+            continue;
+        }
+        auto task = std::move(tasks_queue_.front());
+        tasks_queue_.pop_front();
+        lck.unlock();
+        task();
+        lck.lock();
+    }
+}
+
+template <typename ResultType>
+void AsyncFuncs<ResultType>::WorkerLoop()
+{
+    TRACEX_METHOD();
+    for (;;) {
+        // wait for a task or a function in the queue or the stop flag
+        std::unique_lock<std::mutex> lck(mtx_);
+        while (tasks_queue_.empty() && funcs_queue_.empty() && !stopped_) {
+            cv_queue_.wait(lck);
+        }
+        if (!tasks_queue_.empty()) {
+            auto task = std::move(tasks_queue_.front());
+            tasks_queue_.pop_front();
+            lck.unlock();
+            task();
+            continue;
+        }
+        if (funcs_queue_.empty()) {
+            // nothing left in the queue and the stop flag is set => quit
+            break;
+        }
+        auto func = std::move(funcs_queue_.front());
+        funcs_queue_.pop();
+        TRACEX(("async func started (%d/%d)")
+               % funcs_running_ % funcs_ready_.size());
+        lck.unlock();
+
+        ResultType result = func();
+
+        lck.lock();
+        funcs_ready_.push_back(result);
+        funcs_running_--;
+        TRACEX(("async func ready (%d/%d)")
+               % funcs_running_ % funcs_ready_.size());
+        cv_.notify_one();
+    }
+}
+
+// A queue passing values from producer threads to a consumer thread:
+// the consumer waits for the values until the queue is closed
+template <typename ValueType>
+class AsyncQueue
+{
+  public:
+    void Push(const ValueType& value);
+    void Close();
+    std::list<ValueType> Pop(size_t n);  // waits for n values or the close
+
+  private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::list<ValueType> values_;
+    bool closed_ = {false};
+};
+
+template <typename ValueType>
+void AsyncQueue<ValueType>::Push(const ValueType& value)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    values_.push_back(value);
+    cv_.notify_one();
+}
+
+template <typename ValueType>
+void AsyncQueue<ValueType>::Close()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    closed_ = true;
     cv_.notify_one();
 }
 
+template <typename ValueType>
+std::list<ValueType> AsyncQueue<ValueType>::Pop(size_t n)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    while (values_.size() < n && !closed_) {
+        cv_.wait(lck);
+    }
+    std::list<ValueType> values;
+    while (values.size() < n && !values_.empty()) {
+        values.splice(values.end(), values_, values_.begin());
+    }
+    return values;
+}
+
 } // namespace aux
 } // namespace external_sort
 
@@ -0,0 +1,63 @@
+#ifndef BLOCK_CALLBACK_WRITE_HPP
+#define BLOCK_CALLBACK_WRITE_HPP
+
+#include <functional>
+
+#include "block_types.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockCallbackWritePolicy
+
+// Hands the written blocks over to a user callback instead of a file.
+// The callback is called from the thread of the output stream, one block
+// at a time and in order; the block is only valid during the call.
+template <typename Block>
+class BlockCallbackWritePolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+    using Callback = std::function<void(const Block&)>;
+
+    /// Policy interface
+    void Open() {}
+    void Close() {}
+    void Write(const BlockPtr& block);
+
+    /// Set/get properties
+    void set_output_callback(Callback cb) { output_callback_ = cb; }
+
+    // the values are handed over, nothing to fail
+    bool output_failed() const { return false; }
+
+  private:
+    TRACEX_NAME("BlockCallbackWritePolicy");
+
+    size_t block_cnt_ = 0;
+    Callback output_callback_;
+};
+
+/// ----------------------------------------------------------------------------
+/// Policy interface methods
+
+template <typename Block>
+void BlockCallbackWritePolicy<Block>::Write(const BlockPtr& block)
+{
+    // egnore empty blocks
+    if (!block || block->empty()) {
+        return;
+    }
+
+    TRACEX(("block %014p => callback (%s), bsize = %d")
+           % BlockTraits<Block>::RawPtr(block) % block_cnt_ % block->size());
+    output_callback_(*block);
+    block_cnt_++;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
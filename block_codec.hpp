@@ -0,0 +1,278 @@
+#ifndef BLOCK_CODEC_HPP
+#define BLOCK_CODEC_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockCodec
+
+// Codec of integer values (4 or 8 bytes) for temporary runs: the values are
+// encoded in frames of up to CODEC_FRAME values, each frame can be decoded on
+// its own. A frame keeps its first value and the deltas to the previous
+// values (mod 2^bits, so any order of values round-trips, but sorted values
+// give small deltas). The deltas are bit-packed in miniblocks of 8 lanes with
+// a bit width per miniblock; the lanes are packed in lockstep, so the packing
+// loops are vectorized by the compiler (8 lanes = one AVX2 register).
+//
+// Frame: [count:u32][bytes:u32][first value][widths:u8 * nmini, padded]
+//        [packed words]; every part is a multiple of sizeof(T)
+//
+// Encoded file: [magic:u64][sizeof(T):u32][0:u32] frame frame ...
+
+// max number of values in a frame
+const size_t CODEC_FRAME = 64 << 10;
+
+// encoded file header
+const uint64_t CODEC_MAGIC = 0x314e555254524f53ULL;    // "SORTRUN1"
+const size_t CODEC_HEADER = 16;
+
+template <typename T>
+struct BlockCodec
+{
+    static const bool supported = std::is_integral<T>::value &&
+                                  (sizeof(T) == 4 || sizeof(T) == 8);
+
+    using Word = typename std::conditional<sizeof(T) == 8,
+                                           uint64_t, uint32_t>::type;
+    static const size_t BITS = sizeof(Word) * 8;
+    static const size_t LANES = 8;
+    static const size_t MINI = LANES * BITS;    // deltas per miniblock
+    static const size_t FRAME_HEADER = 8;
+
+    // layout of a frame of n values: its number of miniblocks and the size
+    // of its head (header, first value and widths; the packed words follow)
+    static size_t Minis(size_t n) { return n ? (n - 2 + MINI) / MINI : 0; }
+    static size_t HeadBytes(size_t n) {
+        return FRAME_HEADER + sizeof(T) + WidthsBytes(Minis(n));
+    }
+    static const size_t HEAD_MAX = FRAME_HEADER + sizeof(T) +
+                                   CODEC_FRAME / MINI + sizeof(Word);
+
+    // size of a packed miniblock of bit width w
+    static size_t MiniBytes(unsigned w) { return w * LANES * sizeof(Word); }
+
+    // writes the head of a frame of n values (widths of its miniblocks)
+    static void FrameHead(char* out, size_t n, size_t bytes, const T& first,
+                          const uint8_t* widths);
+
+    // returns the size/the number of values of the frame starting at in
+    // (FRAME_HEADER bytes needed), its first value and its widths
+    static size_t FrameBytes(const char* in);
+    static size_t FrameCount(const char* in);
+    static T FrameFirst(const char* in);
+    static const uint8_t* FrameWidths(const char* in);
+
+    // bit width of the deltas of the cnt (<= MINI) values following *in
+    static unsigned MiniWidth(const T* in, size_t cnt);
+
+    // packs the deltas of the cnt values following *in into out (width w),
+    // returns the end of the packed words; out may overlap the values
+    // (the deltas are taken first)
+    static char* EncodeMini(const T* in, size_t cnt, unsigned w, char* out);
+
+    // unpacks a miniblock of width w into the cnt values following prev
+    // (updated), returns the end of the packed words; out may overlap in
+    // (the deltas are unpacked first)
+    static const char* DecodeMini(const char* in, unsigned w, size_t cnt,
+                                  Word& prev, T* out);
+
+    // writes/checks the header of an encoded file (CODEC_HEADER bytes)
+    static void FileHeader(char* out);
+    static bool IsFileHeader(const char* in);
+
+  private:
+    static size_t WidthsBytes(size_t nmini) {
+        return (nmini + sizeof(Word) - 1) / sizeof(Word) * sizeof(Word);
+    }
+    static unsigned Width(Word x) {
+        unsigned w = 0;
+        for (; x; x >>= 1) {
+            w++;
+        }
+        return w;
+    }
+    static Word* Pack(const Word* in, Word* out, unsigned w);
+    static const Word* Unpack(const Word* in, Word* out, unsigned w);
+};
+
+template <typename T> const bool BlockCodec<T>::supported;
+template <typename T> const size_t BlockCodec<T>::BITS;
+template <typename T> const size_t BlockCodec<T>::LANES;
+template <typename T> const size_t BlockCodec<T>::MINI;
+template <typename T> const size_t BlockCodec<T>::FRAME_HEADER;
+template <typename T> const size_t BlockCodec<T>::HEAD_MAX;
+
+template <typename T>
+auto BlockCodec<T>::Pack(const Word* in, Word* out, unsigned w) -> Word*
+{
+    // BITS values per lane take w words per lane
+    Word acc[LANES] = {};
+    unsigned fill = 0;
+    for (size_t i = 0; i < BITS; i++) {
+        const Word* v = in + i * LANES;
+        for (size_t j = 0; j < LANES; j++) {
+            acc[j] |= v[j] << fill;
+        }
+        fill += w;
+        if (fill >= BITS) {
+            fill -= BITS;
+            for (size_t j = 0; j < LANES; j++) {
+                out[j] = acc[j];
+                acc[j] = fill ? v[j] >> (w - fill) : 0;
+            }
+            out += LANES;
+        }
+    }
+    return out;
+}
+
+template <typename T>
+auto BlockCodec<T>::Unpack(const Word* in, Word* out, unsigned w)
+    -> const Word*
+{
+    const Word mask = (w == BITS) ? ~Word(0) : (Word(1) << w) - 1;
+    unsigned fill = 0;
+    for (size_t i = 0; i < BITS; i++) {
+        Word* v = out + i * LANES;
+        for (size_t j = 0; j < LANES; j++) {
+            v[j] = in[j] >> fill;
+        }
+        if (fill + w > BITS) {
+            // the value continues in the next word
+            in += LANES;
+            for (size_t j = 0; j < LANES; j++) {
+                v[j] |= in[j] << (BITS - fill);
+            }
+            fill = fill + w - BITS;
+        } else {
+            fill += w;
+            if (fill == BITS) {
+                in += LANES;
+                fill = 0;
+            }
+        }
+        for (size_t j = 0; j < LANES; j++) {
+            v[j] &= mask;
+        }
+    }
+    return in;
+}
+
+template <typename T>
+void BlockCodec<T>::FrameHead(char* out, size_t n, size_t bytes,
+                              const T& first, const uint8_t* widths)
+{
+    uint32_t count = n, size = bytes;
+    memcpy(out, &count, sizeof(count));
+    memcpy(out + sizeof(count), &size, sizeof(size));
+    memcpy(out + FRAME_HEADER, &first, sizeof(T));
+    size_t nmini = Minis(n);
+    memcpy(out + FRAME_HEADER + sizeof(T), widths, nmini);
+    memset(out + FRAME_HEADER + sizeof(T) + nmini, 0,
+           WidthsBytes(nmini) - nmini);
+}
+
+template <typename T>
+size_t BlockCodec<T>::FrameBytes(const char* in)
+{
+    uint32_t bytes;
+    memcpy(&bytes, in + sizeof(uint32_t), sizeof(bytes));
+    return bytes;
+}
+
+template <typename T>
+size_t BlockCodec<T>::FrameCount(const char* in)
+{
+    uint32_t count;
+    memcpy(&count, in, sizeof(count));
+    return count;
+}
+
+template <typename T>
+T BlockCodec<T>::FrameFirst(const char* in)
+{
+    T first;
+    memcpy(&first, in + FRAME_HEADER, sizeof(T));
+    return first;
+}
+
+template <typename T>
+const uint8_t* BlockCodec<T>::FrameWidths(const char* in)
+{
+    return reinterpret_cast<const uint8_t*>(in + FRAME_HEADER + sizeof(T));
+}
+
+template <typename T>
+unsigned BlockCodec<T>::MiniWidth(const T* in, size_t cnt)
+{
+    Word bits = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        bits |= Word(in[i + 1]) - Word(in[i]);
+    }
+    return Width(bits);
+}
+
+template <typename T>
+char* BlockCodec<T>::EncodeMini(const T* in, size_t cnt, unsigned w,
+                                char* out)
+{
+    // deltas of the miniblock (the last one is padded with zeros)
+    Word deltas[MINI];
+    for (size_t i = 0; i < cnt; i++) {
+        deltas[i] = Word(in[i + 1]) - Word(in[i]);
+    }
+    for (size_t i = cnt; i < MINI; i++) {
+        deltas[i] = 0;
+    }
+    if (w) {
+        out = reinterpret_cast<char*>(
+            Pack(deltas, reinterpret_cast<Word*>(out), w));
+    }
+    return out;
+}
+
+template <typename T>
+const char* BlockCodec<T>::DecodeMini(const char* in, unsigned w, size_t cnt,
+                                      Word& prev, T* out)
+{
+    Word deltas[MINI];
+    if (w) {
+        in = reinterpret_cast<const char*>(
+            Unpack(reinterpret_cast<const Word*>(in), deltas, w));
+    } else {
+        memset(deltas, 0, sizeof(deltas));
+    }
+    for (size_t i = 0; i < cnt; i++) {
+        prev += deltas[i];
+        out[i] = T(prev);
+    }
+    return in;
+}
+
+template <typename T>
+void BlockCodec<T>::FileHeader(char* out)
+{
+    uint32_t size = sizeof(T), zero = 0;
+    memcpy(out, &CODEC_MAGIC, sizeof(CODEC_MAGIC));
+    memcpy(out + 8, &size, sizeof(size));
+    memcpy(out + 12, &zero, sizeof(zero));
+}
+
+template <typename T>
+bool BlockCodec<T>::IsFileHeader(const char* in)
+{
+    char header[CODEC_HEADER];
+    FileHeader(header);
+    return memcmp(in, header, CODEC_HEADER) == 0;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
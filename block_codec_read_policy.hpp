@@ -0,0 +1,315 @@
+#ifndef BLOCK_CODEC_READ_HPP
+#define BLOCK_CODEC_READ_HPP
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "block_types.hpp"
+#include "block_codec.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockCodecReadPolicy
+
+// Read policy decoding the blocks (BlockCodec) on top of another read policy,
+// if the input is set to be encoded (a run written encoded by the library);
+// otherwise the blocks are read as they are. An encoded input must start
+// with the codec header, a truncated or corrupted one fails the stream
+// (input_failed) rather than ending it quietly. The frames are decoded straight into the block:
+// the packed miniblocks are read (ReadBytes of the other policy) into the
+// free end of the block and decoded into its front, as many as fit, so no
+// memory is needed beyond the block. The input range of an encoded file is
+// a range of its values (in bytes): the frames before the offset are skipped
+// by their sizes, the values before it in its frame are decoded and dropped.
+// A block too small for a miniblock (tiny pools only) gets its values from
+// a miniblock decoded aside, in a buffer of the stream, as many as fit.
+// If the codec is not enabled for the value type, it's just the other read
+// policy
+template <typename Block, typename ReadPolicy, bool Enabled>
+class BlockCodecReadPolicy : public ReadPolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+    using Codec = BlockCodec<ValueType>;
+
+    /// Policy interface
+    void Open();
+    void Read(BlockPtr& block);
+    bool Empty() const;
+    static const size_t ASYNC_DEPTH = 0;    // a block at a time
+
+    /// Set/get properties
+    // reads only size bytes starting at offset (size = 0 - up to the end)
+    void set_input_range(size_t offset, size_t size) {
+        range_offset_ = offset;
+        range_size_ = size;
+    }
+
+    void set_input_encoded(bool encoded) { encoded_ = encoded; }
+    bool input_encoded() const { return encoded_; }
+
+    // was the encoded input truncated or corrupted (or the file not read)?
+    bool input_failed() const {
+        return failed_ || ReadPolicy::input_failed();
+    }
+
+  private:
+    bool NextFrame();
+    bool DecodeMinis(ValueType* out, size_t& size, size_t capacity);
+    void Fail();
+
+  private:
+    TRACEX_NAME("BlockCodecReadPolicy");
+
+    bool encoded_ = {false};
+    bool failed_ = {false};             // truncated or corrupted file
+    char head_[Codec::HEAD_MAX];        // head of the current frame
+    size_t frame_count_ = 0;            // values of the current frame
+    size_t frame_pos_ = 0;              //   decoded so far
+    size_t frame_mini_ = 0;             // next miniblock
+    size_t frame_left_ = 0;             // bytes of the frame not read yet
+    typename Codec::Word prev_ = 0;     // last value decoded
+    size_t skip_ = 0;                   // values to skip (range offset)
+    size_t range_offset_ = 0;
+    size_t range_size_ = 0;
+    size_t range_left_ = 0;
+    std::vector<ValueType> spill_;      // miniblock decoded aside
+    size_t spill_pos_ = 0;              //   values handed over so far
+};
+
+template <typename Block, typename ReadPolicy>
+class BlockCodecReadPolicy<Block, ReadPolicy, false> : public ReadPolicy
+{
+  public:
+    void set_input_encoded(bool) {}
+    bool input_encoded() const { return false; }
+};
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+void BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::Open()
+{
+    failed_ = false;
+    if (!encoded_) {
+        ReadPolicy::set_input_range(range_offset_, range_size_);
+        ReadPolicy::Open();
+        return;
+    }
+
+    ReadPolicy::set_input_range(0, 0);
+    ReadPolicy::Open();
+    skip_ = range_offset_ / sizeof(ValueType);
+    range_left_ = range_size_;
+    frame_count_ = frame_pos_ = 0;
+    frame_left_ = 0;
+    spill_.clear();
+    spill_pos_ = 0;
+    char header[CODEC_HEADER];
+    if (ReadPolicy::ReadBytes(header, CODEC_HEADER) < CODEC_HEADER ||
+        !Codec::IsFileHeader(header)) {
+        Fail();
+    }
+}
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+bool BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::Empty() const
+{
+    if (!encoded_) {
+        return ReadPolicy::Empty();
+    }
+    return failed_ ||
+           (spill_.empty() && frame_pos_ == frame_count_ &&
+            ReadPolicy::Empty()) ||
+           (range_size_ && !range_left_);
+}
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+void BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::Fail()
+{
+    LOG_ERR(("Truncated or corrupted encoded file: %s")
+            % ReadPolicy::input_filename());
+    failed_ = true;
+    frame_pos_ = frame_count_;
+}
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+bool BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::NextFrame()
+{
+    // the rest of the last frame (padding)
+    ReadPolicy::SkipBytes(frame_left_);
+    frame_left_ = 0;
+    if (ReadPolicy::Empty()) {
+        return false;
+    }
+
+    // read the head of the next frame (whole frames to skip are passed by)
+    const size_t header = Codec::FRAME_HEADER;
+    size_t n, bytes, head;
+    while (true) {
+        if (ReadPolicy::ReadBytes(head_, header) < header) {
+            Fail();
+            return false;
+        }
+        n = Codec::FrameCount(head_);
+        bytes = Codec::FrameBytes(head_);
+        head = Codec::HeadBytes(n);
+        if (n == 0 || n > CODEC_FRAME || bytes < head) {
+            Fail();
+            return false;
+        }
+        if (skip_ < n) {
+            break;
+        }
+        skip_ -= n;
+        ReadPolicy::SkipBytes(bytes - header);
+        if (ReadPolicy::Empty()) {
+            return false;
+        }
+    }
+    if (ReadPolicy::ReadBytes(head_ + header, head - header) < head - header) {
+        Fail();
+        return false;
+    }
+    size_t packed = 0;
+    const uint8_t* widths = Codec::FrameWidths(head_);
+    for (size_t m = 0; m < Codec::Minis(n); m++) {
+        if (widths[m] > Codec::BITS) {
+            Fail();
+            return false;
+        }
+        packed += Codec::MiniBytes(widths[m]);
+    }
+    if (packed > bytes - head) {
+        Fail();
+        return false;
+    }
+
+    frame_count_ = n;
+    frame_pos_ = 0;
+    frame_mini_ = 0;
+    frame_left_ = bytes - head;
+    prev_ = Codec::FrameFirst(head_);
+    return true;
+}
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+bool BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::DecodeMinis(
+    ValueType* out, size_t& size, size_t capacity)
+{
+    // the next miniblocks fitting in the rest of the block: the packed
+    // words of a miniblock are never larger than its values, except
+    // for the last (short) miniblock of the frame
+    const size_t MINI = Codec::MINI;
+    const uint8_t* widths = Codec::FrameWidths(head_);
+    size_t room = (capacity - size) * sizeof(ValueType);
+    size_t last = frame_mini_, bytes = 0, packed = 0;
+    for (; last < Codec::Minis(frame_count_); last++) {
+        size_t cnt = std::min(MINI, frame_count_ - 1 - last * MINI);
+        size_t mbytes = Codec::MiniBytes(widths[last]);
+        if (bytes + std::max(cnt * sizeof(ValueType), mbytes) > room) {
+            break;
+        }
+        bytes += cnt * sizeof(ValueType);
+        packed += mbytes;
+    }
+    if (last == frame_mini_) {
+        return false;
+    }
+
+    // read them into the end of the block, decode into the front
+    char* buf = reinterpret_cast<char*>(out + capacity) - packed;
+    if (ReadPolicy::ReadBytes(buf, packed) < packed) {
+        Fail();
+        return false;
+    }
+    frame_left_ -= packed;
+    const char* in = buf;
+    for (; frame_mini_ < last; frame_mini_++) {
+        size_t cnt = std::min(MINI, frame_count_ - 1 - frame_mini_ * MINI);
+        in = Codec::DecodeMini(in, widths[frame_mini_], cnt, prev_,
+                               out + size);
+        size += cnt;
+        frame_pos_ += cnt;
+    }
+    return true;
+}
+
+template <typename Block, typename ReadPolicy, bool Enabled>
+void BlockCodecReadPolicy<Block, ReadPolicy, Enabled>::Read(BlockPtr& block)
+{
+    if (!encoded_) {
+        ReadPolicy::Read(block);
+        return;
+    }
+
+    size_t capacity = block->capacity();
+    size_t limit = capacity;
+    if (range_size_) {
+        limit = std::min(limit, range_left_ / sizeof(ValueType));
+    }
+    block->resize(capacity);
+    ValueType* out = block->data();
+    size_t size = 0;
+
+    while (size < limit) {
+        if (!spill_.empty()) {
+            // the rest of the miniblock decoded aside
+            size_t cnt = std::min(capacity - size, spill_.size() - spill_pos_);
+            std::copy(spill_.begin() + spill_pos_,
+                      spill_.begin() + spill_pos_ + cnt, out + size);
+            size += cnt;
+            spill_pos_ += cnt;
+            if (spill_pos_ == spill_.size()) {
+                spill_.clear();
+                spill_pos_ = 0;
+            }
+        } else {
+            if (frame_pos_ == frame_count_ && !NextFrame()) {
+                break;
+            }
+            if (frame_pos_ == 0) {
+                out[size++] = ValueType(prev_);
+                frame_pos_++;
+            } else if (!DecodeMinis(out, size, capacity)) {
+                // the block is full, unless it's too small for a miniblock
+                const size_t MINI = Codec::MINI;
+                size_t cnt = 0;
+                if ((size && capacity >= MINI) || failed_) {
+                    break;
+                }
+                spill_.resize(MINI);
+                if (!DecodeMinis(spill_.data(), cnt, MINI)) {
+                    spill_.clear();
+                    break;
+                }
+                spill_.resize(cnt);
+                spill_pos_ = 0;
+                continue;
+            }
+        }
+
+        // the values before the range offset are dropped
+        if (skip_) {
+            size_t drop = std::min(skip_, size);
+            memmove(out, out + drop, (size - drop) * sizeof(ValueType));
+            size -= drop;
+            skip_ -= drop;
+        }
+    }
+
+    block->resize(std::min(size, limit));
+    if (range_size_) {
+        range_left_ -= block->size() * sizeof(ValueType);
+    }
+    TRACEX(("block %014p <= decoded, size = %s")
+           % BlockTraits<Block>::RawPtr(block) % block->size());
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef BLOCK_CODEC_WRITE_HPP
+#define BLOCK_CODEC_WRITE_HPP
+
+#include <algorithm>
+
+#include "block_types.hpp"
+#include "block_codec.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockCodecWritePolicy
+
+// Write policy encoding the blocks (BlockCodec) on top of another write
+// policy, if the output is set to be encoded (temporary runs); otherwise the
+// blocks are written as they are. The frames are packed in place, over the
+// values of the block (it's free once written), so no memory is needed
+// beyond the block; the other policy writes them with WriteBytes. If the
+// codec is not enabled for the value type, it's just the other write policy
+// (see the specialization below)
+template <typename Block, typename WritePolicy, bool Enabled>
+class BlockCodecWritePolicy : public WritePolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+    using Codec = BlockCodec<ValueType>;
+
+    /// Policy interface
+    void Open();
+    void Close();
+    void Write(const BlockPtr& block);
+    static const size_t ASYNC_DEPTH = 0;    // a block at a time
+
+    /// Set/get properties
+    void set_output_encoded(bool encoded) { encoded_ = encoded; }
+    bool output_encoded() const { return encoded_; }
+
+  private:
+    void WriteFrame(ValueType* in, size_t n);
+
+  private:
+    TRACEX_NAME("BlockCodecWritePolicy");
+
+    bool encoded_ = {false};
+    size_t bytes_in_ = 0;
+    size_t bytes_out_ = 0;
+};
+
+template <typename Block, typename WritePolicy>
+class BlockCodecWritePolicy<Block, WritePolicy, false> : public WritePolicy
+{
+  public:
+    void set_output_encoded(bool) {}
+    bool output_encoded() const { return false; }
+};
+
+template <typename Block, typename WritePolicy, bool Enabled>
+void BlockCodecWritePolicy<Block, WritePolicy, Enabled>::Open()
+{
+    WritePolicy::Open();
+    if (encoded_) {
+        char header[CODEC_HEADER];
+        Codec::FileHeader(header);
+        WritePolicy::WriteBytes(header, CODEC_HEADER);
+    }
+}
+
+template <typename Block, typename WritePolicy, bool Enabled>
+void BlockCodecWritePolicy<Block, WritePolicy, Enabled>::Close()
+{
+    WritePolicy::Close();
+    if (encoded_ && bytes_in_) {
+        LOG_INF(("encoded %s: %d => %d bytes")
+                % WritePolicy::output_filename() % bytes_in_ % bytes_out_);
+    }
+}
+
+template <typename Block, typename WritePolicy, bool Enabled>
+void BlockCodecWritePolicy<Block, WritePolicy, Enabled>::Write(
+    const BlockPtr& block)
+{
+    if (!encoded_) {
+        WritePolicy::Write(block);
+        return;
+    }
+    if (!block || block->empty()) {
+        return;
+    }
+
+    // encode the block in frames
+    size_t n = block->size();
+    for (size_t i = 0; i < n; i += CODEC_FRAME) {
+        WriteFrame(block->data() + i, std::min(CODEC_FRAME, n - i));
+    }
+    bytes_in_ += n * sizeof(ValueType);
+}
+
+template <typename Block, typename WritePolicy, bool Enabled>
+void BlockCodecWritePolicy<Block, WritePolicy, Enabled>::WriteFrame(
+    ValueType* in, size_t n)
+{
+    // the widths first, the head of the frame is written before the values
+    // are packed over
+    const size_t MINI = Codec::MINI;
+    size_t nmini = Codec::Minis(n);
+    uint8_t widths[CODEC_FRAME / MINI + 1];
+    size_t bytes = Codec::HeadBytes(n);
+    for (size_t m = 0; m < nmini; m++) {
+        size_t first = m * MINI;
+        widths[m] = Codec::MiniWidth(in + first,
+                                     std::min(MINI, n - 1 - first));
+        bytes += Codec::MiniBytes(widths[m]);
+    }
+    char head[Codec::HEAD_MAX];
+    Codec::FrameHead(head, n, bytes, in[0], widths);
+    WritePolicy::WriteBytes(head, Codec::HeadBytes(n));
+
+    // a miniblock is packed over its own values (its words never take more
+    // room than its deltas), only the last one may not fit in the frame:
+    // it's packed aside
+    char* begin = reinterpret_cast<char*>(in);
+    char* end = reinterpret_cast<char*>(in + n);
+    char* out = begin;
+    for (size_t m = 0; m < nmini; m++) {
+        size_t first = m * MINI;
+        size_t cnt = std::min(MINI, n - 1 - first);
+        if (out + Codec::MiniBytes(widths[m]) <= end) {
+            out = Codec::EncodeMini(in + first, cnt, widths[m], out);
+        } else {
+            typename Codec::Word tail[MINI];
+            WritePolicy::WriteBytes(begin, out - begin);
+            char* last = reinterpret_cast<char*>(tail);
+            WritePolicy::WriteBytes(last, Codec::EncodeMini(
+                in + first, cnt, widths[m], last) - last);
+            begin = out;
+        }
+    }
+    WritePolicy::WriteBytes(begin, out - begin);
+    bytes_out_ += bytes;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef BLOCK_DIRECT_FILE_HPP
+#define BLOCK_DIRECT_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "block_types.hpp"
+#include "block_file_io.hpp"
+
+// not every platform has O_DIRECT (the page cache is used then)
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+namespace external_sort {
+namespace block {
+
+// O_DIRECT i/o needs the file offsets, the sizes and the memory buffers
+// to be aligned to the logical block size of the device (at most a page)
+const size_t DIRECT_IO_ALIGN = 4096;
+
+inline size_t direct_align_down(size_t x)
+{
+    return x / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+}
+
+inline size_t direct_align_up(size_t x)
+{
+    return direct_align_down(x + DIRECT_IO_ALIGN - 1);
+}
+
+// Allocator of aligned memory: the blocks are read and written directly
+template <typename T>
+struct DirectAllocator
+{
+    using value_type = T;
+
+    DirectAllocator() = default;
+    template <typename U>
+    DirectAllocator(const DirectAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, DIRECT_IO_ALIGN,
+                           direct_align_up(n * sizeof(T))) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { free(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const DirectAllocator<T>&, const DirectAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const DirectAllocator<T>&, const DirectAllocator<U>&)
+{
+    return false;
+}
+
+// Block of a direct i/o stream: its memory is aligned, and the pool makes
+// its size a multiple of the alignment (if it's big enough)
+template <typename T>
+using DirectBlock = std::vector<T, DirectAllocator<T>>;
+
+template <typename T>
+struct BlockAlign<DirectBlock<T>>
+{
+    static const size_t value = DIRECT_IO_ALIGN;
+};
+
+// opens the file with O_DIRECT, or without it if the file system
+// doesn't support it; returns the file descriptor (-1 on error)
+inline int direct_open(const std::string& filename, int flags)
+{
+    int fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        LOG_INF(("no direct i/o for %s") % filename);
+        fd = ::open(filename.c_str(), flags, 0644);
+    }
+    return fd;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef BLOCK_DIRECT_READ_HPP
+#define BLOCK_DIRECT_READ_HPP
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "block_types.hpp"
+#include "block_direct_file.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockDirectReadPolicy
+
+// Drop-in replacement of BlockFileReadPolicy reading the file with O_DIRECT,
+// bypassing the page cache. The aligned part of the file holding the values
+// of a block is read straight into the block (DirectBlock, aligned memory);
+// if the input range doesn't start at an aligned offset, the values are
+// moved down to the block start. A block too small for an aligned read is
+// read through a buffered descriptor
+template <typename Block>
+class BlockDirectReadPolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+
+    static_assert(BlockAlign<Block>::value % DIRECT_IO_ALIGN == 0,
+                  "direct i/o needs aligned blocks (DirectBlock)");
+
+    /// Policy interface
+    void Open();
+    void Close();
+    void Read(BlockPtr& block);
+    bool Empty() const;
+
+    /// Set/get properties
+    void set_input_filename(const std::string& ifn) { input_filename_ = ifn; }
+    const std::string& input_filename() const { return input_filename_; }
+
+    void set_input_rm_file(bool rm) { input_rm_file_ = rm; }
+    bool input_rm_file() const { return input_rm_file_; }
+
+    // reads only size bytes starting at offset (size = 0 - up to the end)
+    void set_input_range(size_t offset, size_t size) {
+        input_offset_ = offset;
+        input_size_ = size;
+    }
+
+    // the page cache is bypassed anyway
+    void set_input_drop_cache(bool) {}
+
+    // the file could not be opened or read (or shrank while being read)
+    bool input_failed() const { return input_failed_; }
+
+  private:
+    void FileOpen();
+    void FileRead(BlockPtr& block);
+    void FileClose();
+    void FileFail(const char* what);
+
+  private:
+    TRACEX_NAME("BlockDirectReadPolicy");
+
+    int fd_ = -1;                       // direct descriptor
+    int fd_buffered_ = -1;              // buffered descriptor (small blocks)
+    std::string input_filename_;
+    bool input_rm_file_ = {false};
+    size_t input_offset_ = 0;
+    size_t input_size_ = 0;
+    size_t input_pos_ = 0;              // next byte to read
+    size_t input_end_ = 0;              // end of the input range
+    bool input_failed_ = {false};
+    size_t block_cnt_ = 0;
+};
+
+/// ----------------------------------------------------------------------------
+/// Policy interface methods
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::Open()
+{
+    TRACEX_METHOD();
+    FileOpen();
+}
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::Close()
+{
+    TRACEX_METHOD();
+    FileClose();
+}
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::Read(BlockPtr& block)
+{
+    FileRead(block);
+    block_cnt_++;
+}
+
+template <typename Block>
+bool BlockDirectReadPolicy<Block>::Empty() const
+{
+    return fd_ < 0 || input_end_ - input_pos_ < sizeof(ValueType);
+}
+
+/// ----------------------------------------------------------------------------
+/// File operations
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::FileOpen()
+{
+    LOG_INF(("opening file r %s (direct)") % input_filename_);
+    TRACEX(("input file %s") % input_filename_);
+    input_pos_ = input_end_ = 0;
+    fd_ = direct_open(input_filename_, O_RDONLY);
+    if (fd_ >= 0) {
+        fd_buffered_ = ::open(input_filename_.c_str(), O_RDONLY);
+    }
+    struct stat st;
+    input_failed_ = false;
+    if (fd_ < 0 || fd_buffered_ < 0 || fstat(fd_, &st) != 0) {
+        FileFail("open");
+        return;
+    }
+
+    // the range is cut to the file size
+    size_t file_size = st.st_size;
+    input_pos_ = std::min(input_offset_, file_size);
+    input_end_ = input_size_ ? std::min(input_pos_ + input_size_, file_size)
+                             : file_size;
+}
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::FileRead(BlockPtr& block)
+{
+    block->resize(block->capacity());
+    char* data = reinterpret_cast<char*>(block->data());
+    size_t room = direct_align_down(block->capacity() * sizeof(ValueType));
+    size_t head = input_pos_ - direct_align_down(input_pos_);
+    size_t left = (input_end_ - input_pos_) / sizeof(ValueType) *
+                  sizeof(ValueType);
+
+    ssize_t n;
+    size_t bsize = 0;
+    if (room > head) {
+        bsize = std::min(left, (room - head) / sizeof(ValueType) *
+                               sizeof(ValueType));
+    }
+    if (bsize) {
+        // the aligned part of the file holding the values
+        n = file_pread(fd_, data, direct_align_up(head + bsize),
+                       input_pos_ - head);
+        if (n >= 0) {
+            n = std::min<ssize_t>(std::max<ssize_t>(n - ssize_t(head), 0),
+                                  bsize);
+        }
+        if (head && n > 0) {
+            memmove(data, data + head, n);
+        }
+    } else {
+        bsize = std::min(left, block->size() * sizeof(ValueType));
+        n = file_pread(fd_buffered_, data, bsize, input_pos_);
+    }
+    if (n < 0 || size_t(n) < bsize) {
+        // a read error or the file is shorter than it was
+        errno = n < 0 ? errno : 0;
+        FileFail("read");
+        block->clear();
+        return;
+    }
+
+    block->resize(n / sizeof(ValueType));
+    input_pos_ += block->size() * sizeof(ValueType);
+    TRACEX(("block %014p <= file (%s), is_over = %s, size = %s")
+           % BlockTraits<Block>::RawPtr(block)
+           % block_cnt_ % Empty() % block->size());
+}
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::FileClose()
+{
+    if (fd_buffered_ >= 0) {
+        ::close(fd_buffered_);
+        fd_buffered_ = -1;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        if (input_rm_file_ && !input_failed_) {
+            if (remove(input_filename_.c_str()) != 0) {
+                LOG_ERR(("Failed to remove file: %s") % input_filename_);
+            }
+        }
+    }
+}
+
+template <typename Block>
+void BlockDirectReadPolicy<Block>::FileFail(const char* what)
+{
+    LOG_ERR(("Failed to %s input file: %s (%s)") % what % input_filename_
+            % (errno ? strerror(errno) : "unexpected end of file"));
+    input_failed_ = true;
+    input_end_ = input_pos_;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef BLOCK_DIRECT_WRITE_HPP
+#define BLOCK_DIRECT_WRITE_HPP
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+#include "block_types.hpp"
+#include "block_direct_file.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockDirectWritePolicy
+
+// Drop-in replacement of BlockFileWritePolicy writing the file with O_DIRECT,
+// bypassing the page cache. The blocks are written straight from their
+// memory (DirectBlock, aligned); the unaligned parts - the head of a block
+// up to an aligned offset and its tail - go through a second, buffered
+// descriptor. After an unaligned head the rest of the block is moved down
+// to the block start to be written aligned (the block is not needed after
+// it's written)
+template <typename Block>
+class BlockDirectWritePolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+
+    static_assert(BlockAlign<Block>::value % DIRECT_IO_ALIGN == 0,
+                  "direct i/o needs aligned blocks (DirectBlock)");
+
+    /// Policy interface
+    void Open();
+    void Close();
+    void Write(const BlockPtr& block);
+
+    /// Set/get properties
+    void set_output_filename(const std::string& ofn) { output_filename_ = ofn; }
+    const std::string& output_filename() const { return output_filename_; }
+
+    // writes into the existing file starting at offset (no truncation)
+    void set_output_offset(size_t offset) {
+        output_offset_ = offset;
+        output_inplace_ = true;
+    }
+
+    // the page cache is bypassed anyway
+    void set_output_drop_cache(bool) {}
+
+    // the file could not be opened or written
+    bool output_failed() const { return output_failed_; }
+
+  private:
+    void FileOpen();
+    void FileWrite(const BlockPtr& block);
+    void FileWriteRange(int fd, const char* data, size_t size);
+    void FileClose();
+
+  private:
+    TRACEX_NAME("BlockDirectWritePolicy");
+
+    int fd_ = -1;                       // direct descriptor
+    int fd_buffered_ = -1;              // buffered descriptor (unaligned i/o)
+    size_t block_cnt_ = 0;
+    std::string output_filename_;
+    size_t output_offset_ = 0;
+    size_t output_pos_ = 0;             // next byte to write
+    bool output_inplace_ = {false};
+    bool output_failed_ = {false};
+};
+
+/// ----------------------------------------------------------------------------
+/// Policy interface methods
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::Open()
+{
+    TRACEX_METHOD();
+    FileOpen();
+}
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::Close()
+{
+    TRACEX_METHOD();
+    FileClose();
+}
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::Write(const BlockPtr& block)
+{
+    // egnore empty blocks
+    if (!block || block->empty()) {
+        return;
+    }
+
+    // write the block
+    FileWrite(block);
+    block_cnt_++;
+}
+
+/// ----------------------------------------------------------------------------
+/// File operations
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::FileOpen()
+{
+    LOG_INF(("opening file w %s (direct)") % output_filename_);
+    TRACEX(("output file %s") % output_filename_);
+    int flags = O_WRONLY | O_CREAT | (output_inplace_ ? 0 : O_TRUNC);
+    fd_ = direct_open(output_filename_, flags);
+    if (fd_ >= 0) {
+        fd_buffered_ = ::open(output_filename_.c_str(), O_WRONLY);
+    }
+    output_failed_ = fd_ < 0 || fd_buffered_ < 0;
+    if (output_failed_) {
+        LOG_ERR(("Failed to open output file: %s") % output_filename_);
+    }
+    output_pos_ = output_offset_;
+}
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::FileWriteRange(int fd, const char* data,
+                                                   size_t size)
+{
+    // the rest of a failed output is dropped
+    if (!size || output_failed_) {
+        return;
+    }
+    if (!file_pwrite(fd, data, size, output_pos_)) {
+        LOG_ERR(("Failed to write output file: %s (%s)")
+                % output_filename_ % strerror(errno));
+        output_failed_ = true;
+        return;
+    }
+    output_pos_ += size;
+}
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::FileWrite(const BlockPtr& block)
+{
+    char* data = reinterpret_cast<char*>(block->data());
+    size_t bsize = block->size() * sizeof(ValueType);
+
+    // unaligned head (up to an aligned offset)
+    size_t head = std::min(bsize, direct_align_up(output_pos_) - output_pos_);
+    FileWriteRange(fd_buffered_, data, head);
+
+    // aligned body
+    size_t body = direct_align_down(bsize - head);
+    if (body && head) {
+        memmove(data, data + head, bsize - head);
+    } else {
+        data += head;
+    }
+    FileWriteRange(fd_, data, body);
+
+    // unaligned tail
+    FileWriteRange(fd_buffered_, data + body, bsize - head - body);
+    TRACEX(("block %014p => file (%s), bsize = %d")
+           % BlockTraits<Block>::RawPtr(block) % block_cnt_ % block->size());
+}
+
+template <typename Block>
+void BlockDirectWritePolicy<Block>::FileClose()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (fd_buffered_ >= 0) {
+        ::close(fd_buffered_);
+        fd_buffered_ = -1;
+    }
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef BLOCK_FILE_CACHE_HPP
+#define BLOCK_FILE_CACHE_HPP
+
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace external_sort {
+namespace block {
+
+// the file is dropped from the page cache in windows of this size
+const size_t CACHE_WINDOW = 8 << 20;
+
+/// ----------------------------------------------------------------------------
+/// FileCache
+
+// Page cache management of a file read or written once, sequentially:
+// hints the kernel to read ahead (input) and drops the pages behind the
+// reader or the writer, so the file doesn't push other data out of the
+// cache. Written windows are flushed first (writeback of a window is
+// started as soon as it's full, and waited for one window later).
+// Works on its own descriptor, so it fits any stream implementation
+class FileCache
+{
+  public:
+    FileCache() = default;
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+    ~FileCache() { Close(); }
+
+    // starts managing the file (read or written from pos on)
+    void Open(const std::string& filename, size_t pos, bool input);
+
+    // the file is read/written up to pos
+    void Read(size_t pos);
+    void Write(size_t pos);
+
+    // drops the rest of the file read/written up to pos
+    void Close(size_t pos = 0);
+
+  private:
+    bool Due(size_t pos) const {
+        return fd_ >= 0 && pos >= mark_ + CACHE_WINDOW;
+    }
+    void Drop(size_t from, size_t to);
+
+  private:
+    int fd_ = -1;
+    bool input_ = {false};
+    size_t done_ = 0;                   // the pages before are dropped
+    size_t mark_ = 0;                   // the pages before are read ahead
+                                        // or their writeback is started
+};
+
+inline void FileCache::Open(const std::string& filename, size_t pos,
+                            bool input)
+{
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    input_ = input;
+    done_ = mark_ = pos;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd_ >= 0) {
+        posix_fadvise(fd_, pos, 0, POSIX_FADV_SEQUENTIAL);
+        if (input_) {
+            posix_fadvise(fd_, pos, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+        }
+    }
+#endif
+}
+
+inline void FileCache::Drop(size_t from, size_t to)
+{
+    if (from >= to) {
+        return;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (!input_) {
+        sync_file_range(fd_, from, to - from, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                              SYNC_FILE_RANGE_WRITE |
+                                              SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    if (!input_) {
+        fdatasync(fd_);
+    }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd_, from, to - from, POSIX_FADV_DONTNEED);
+#endif
+}
+
+inline void FileCache::Read(size_t pos)
+{
+    if (!Due(pos)) {
+        return;
+    }
+    Drop(done_, pos);
+    done_ = mark_ = pos;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd_, pos, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+#endif
+}
+
+inline void FileCache::Write(size_t pos)
+{
+    if (!Due(pos)) {
+        return;
+    }
+    // the previous window is written back by now (mostly)
+    Drop(done_, mark_);
+    done_ = mark_;
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd_, mark_, pos - mark_, SYNC_FILE_RANGE_WRITE);
+#endif
+    mark_ = pos;
+}
+
+inline void FileCache::Close(size_t pos)
+{
+    if (fd_ >= 0) {
+        Drop(done_, pos);
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
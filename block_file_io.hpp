@@ -0,0 +1,51 @@
+#ifndef BLOCK_FILE_IO_HPP
+#define BLOCK_FILE_IO_HPP
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace external_sort {
+namespace block {
+
+// reads up to size bytes at offset; returns the number of bytes read,
+// which is less than size only at the end of the file (-1 on error)
+inline ssize_t file_pread(int fd, char* buf, size_t size, size_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// writes size bytes at offset; returns false on error
+inline bool file_pwrite(int fd, const char* buf, size_t size, size_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
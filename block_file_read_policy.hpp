@@ -2,10 +2,17 @@
 #define BLOCK_FILE_READ_HPP
 
 #include <string>
-#include <fstream>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "block_types.hpp"
+#include "block_file_io.hpp"
+#include "block_file_cache.hpp"
 
 namespace external_sort {
 namespace block {
@@ -13,6 +20,7 @@ namespace block {
 /// ----------------------------------------------------------------------------
 /// BlockFileReadPolicy
 
+// Reads the file (or its range) block by block with positional reads
 template <typename Block>
 class BlockFileReadPolicy
 {
@@ -33,17 +41,42 @@ class BlockFileReadPolicy
     void set_input_rm_file(bool rm) { input_rm_file_ = rm; }
     bool input_rm_file() const { return input_rm_file_; }
 
+    // reads only size bytes starting at offset (size = 0 - up to the end)
+    void set_input_range(size_t offset, size_t size) {
+        input_offset_ = offset;
+        input_size_ = size;
+    }
+
+    // drops the file from the page cache as it's read
+    void set_input_drop_cache(bool drop) { input_drop_cache_ = drop; }
+
+    // the file could not be opened or read (or shrank while being read)
+    bool input_failed() const { return input_failed_; }
+
+    /// Byte-level reads of the range (encoded files)
+    // reads the next size bytes, returns less at the end of the range
+    size_t ReadBytes(char* buf, size_t size);
+    void SkipBytes(size_t size);
+
   private:
     void FileOpen();
     void FileRead(BlockPtr& block);
     void FileClose();
+    void FileFail(const char* what);
 
   private:
     TRACEX_NAME("BlockFileReadPolicy");
 
-    std::ifstream ifs_;
+    int fd_ = -1;
+    FileCache cache_;
     std::string input_filename_;
     bool input_rm_file_ = {false};
+    size_t input_offset_ = 0;
+    size_t input_size_ = 0;
+    size_t input_pos_ = 0;              // next byte to read
+    size_t input_end_ = 0;              // end of the input range
+    bool input_drop_cache_ = {false};
+    bool input_failed_ = {false};
     size_t block_cnt_ = 0;
 };
 
@@ -74,7 +107,7 @@ void BlockFileReadPolicy<Block>::Read(BlockPtr& block)
 template <typename Block>
 bool BlockFileReadPolicy<Block>::Empty() const
 {
-    return !(ifs_.is_open() && ifs_.good());
+    return fd_ < 0 || input_end_ - input_pos_ < sizeof(ValueType);
 }
 
 /// ----------------------------------------------------------------------------
@@ -85,33 +118,79 @@ void BlockFileReadPolicy<Block>::FileOpen()
 {
     LOG_INF(("opening file r %s") % input_filename_);
     TRACEX(("input file %s") % input_filename_);
-    ifs_.open(input_filename_, std::ifstream::in | std::ifstream::binary);
-    if (!ifs_) {
-        LOG_ERR(("Failed to open input file: %s") % input_filename_);
+    input_pos_ = input_end_ = 0;
+    input_failed_ = false;
+    fd_ = ::open(input_filename_.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        FileFail("open");
+        return;
+    }
+
+    // the range is cut to the file size
+    size_t file_size = st.st_size;
+    input_pos_ = std::min(input_offset_, file_size);
+    input_end_ = input_size_ ? std::min(input_pos_ + input_size_, file_size)
+                             : file_size;
+    if (input_drop_cache_) {
+        cache_.Open(input_filename_, input_pos_, true);
     }
 }
 
 template <typename Block>
 void BlockFileReadPolicy<Block>::FileRead(BlockPtr& block)
 {
-    block->resize(block->capacity());
-    std::streamsize bsize = block->size() * sizeof(ValueType);
-
-    ifs_.read(reinterpret_cast<char*>(block->data()), bsize);
-    if (ifs_.gcount() < bsize) {
-        block->resize(ifs_.gcount() / sizeof(ValueType));
+    block->resize(std::min(block->capacity(),
+                           (input_end_ - input_pos_) / sizeof(ValueType)));
+    size_t bsize = block->size() * sizeof(ValueType);
+
+    ssize_t n = file_pread(fd_, reinterpret_cast<char*>(block->data()),
+                           bsize, input_pos_);
+    if (n < 0 || size_t(n) < bsize) {
+        // a read error or the file is shorter than it was
+        errno = n < 0 ? errno : 0;
+        FileFail("read");
+        block->clear();
+        return;
     }
+    input_pos_ += n;
+    cache_.Read(input_pos_);
     TRACEX(("block %014p <= file (%s), is_over = %s, size = %s")
            % BlockTraits<Block>::RawPtr(block)
            % block_cnt_ % Empty() % block->size());
 }
 
+template <typename Block>
+size_t BlockFileReadPolicy<Block>::ReadBytes(char* buf, size_t size)
+{
+    size = std::min(size, input_end_ - input_pos_);
+    ssize_t n = file_pread(fd_, buf, size, input_pos_);
+    if (n < 0 || size_t(n) < size) {
+        // a read error or the file is shorter than it was
+        errno = n < 0 ? errno : 0;
+        FileFail("read");
+        return 0;
+    }
+    input_pos_ += n;
+    cache_.Read(input_pos_);
+    return n;
+}
+
+template <typename Block>
+void BlockFileReadPolicy<Block>::SkipBytes(size_t size)
+{
+    input_pos_ += std::min(size, input_end_ - input_pos_);
+}
+
 template <typename Block>
 void BlockFileReadPolicy<Block>::FileClose()
 {
-    if (ifs_.is_open()) {
-        ifs_.close();
-        if (input_rm_file_) {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        cache_.Close(input_pos_);
+        // a failed input is kept: its data is not in the output
+        if (input_rm_file_ && !input_failed_) {
             if (remove(input_filename_.c_str()) != 0) {
                 LOG_ERR(("Failed to remove file: %s") % input_filename_);
             }
@@ -119,6 +198,15 @@ void BlockFileReadPolicy<Block>::FileClose()
     }
 }
 
+template <typename Block>
+void BlockFileReadPolicy<Block>::FileFail(const char* what)
+{
+    LOG_ERR(("Failed to %s input file: %s (%s)") % what % input_filename_
+            % (errno ? strerror(errno) : "unexpected end of file"));
+    input_failed_ = true;
+    input_end_ = input_pos_;
+}
+
 } // namespace block
 } // namespace external_sort
 
@@ -2,10 +2,14 @@
 #define BLOCK_FILE_WRITE_HPP
 
 #include <string>
-#include <queue>
-#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "block_types.hpp"
+#include "block_file_io.hpp"
+#include "block_file_cache.hpp"
 
 namespace external_sort {
 namespace block {
@@ -13,6 +17,7 @@ namespace block {
 /// ----------------------------------------------------------------------------
 /// BlockFileWritePolicy
 
+// Writes the blocks one after another with positional writes
 template <typename Block>
 class BlockFileWritePolicy
 {
@@ -29,6 +34,21 @@ class BlockFileWritePolicy
     void set_output_filename(const std::string& ofn) { output_filename_ = ofn; }
     const std::string& output_filename() const { return output_filename_; }
 
+    // writes into the existing file starting at offset (no truncation)
+    void set_output_offset(size_t offset) {
+        output_offset_ = offset;
+        output_inplace_ = true;
+    }
+
+    // drops the file from the page cache as it's written
+    void set_output_drop_cache(bool drop) { output_drop_cache_ = drop; }
+
+    // the file could not be opened or written
+    bool output_failed() const { return output_failed_; }
+
+    /// Byte-level writes (encoded files)
+    void WriteBytes(const char* data, size_t size);
+
   private:
     void FileOpen();
     void FileWrite(const BlockPtr& block);
@@ -39,7 +59,13 @@ class BlockFileWritePolicy
 
     size_t block_cnt_ = 0;
     std::string output_filename_;
-    std::ofstream ofs_;
+    int fd_ = -1;
+    FileCache cache_;
+    size_t output_offset_ = 0;
+    size_t output_pos_ = 0;             // next byte to write
+    bool output_inplace_ = {false};
+    bool output_drop_cache_ = {false};
+    bool output_failed_ = {false};
 };
 
 /// ----------------------------------------------------------------------------
@@ -80,25 +106,52 @@ void BlockFileWritePolicy<Block>::FileOpen()
 {
     LOG_INF(("opening file w %s") % output_filename_);
     TRACEX(("output file %s") % output_filename_);
-    ofs_.open(output_filename_, std::ofstream::out | std::ofstream::binary);
-    if (!ofs_) {
-        LOG_ERR(("Failed to open output file: %s") % output_filename_);
+    int flags = O_WRONLY | O_CREAT | (output_inplace_ ? 0 : O_TRUNC);
+    fd_ = ::open(output_filename_.c_str(), flags, 0644);
+    output_failed_ = fd_ < 0;
+    if (output_failed_) {
+        LOG_ERR(("Failed to open output file: %s (%s)")
+                % output_filename_ % strerror(errno));
+    }
+    output_pos_ = output_offset_;
+    if (output_drop_cache_) {
+        cache_.Open(output_filename_, output_pos_, false);
     }
 }
 
 template <typename Block>
 void BlockFileWritePolicy<Block>::FileWrite(const BlockPtr& block)
 {
-    ofs_.write((const char*)block->data(), block->size() * sizeof(ValueType));
+    WriteBytes(reinterpret_cast<const char*>(block->data()),
+               block->size() * sizeof(ValueType));
     TRACEX(("block %014p => file (%s), bsize = %d")
            % BlockTraits<Block>::RawPtr(block) % block_cnt_ % block->size());
 }
 
+template <typename Block>
+void BlockFileWritePolicy<Block>::WriteBytes(const char* data, size_t size)
+{
+    // the rest of a failed output is dropped
+    if (output_failed_) {
+        return;
+    }
+    if (!file_pwrite(fd_, data, size, output_pos_)) {
+        LOG_ERR(("Failed to write output file: %s (%s)")
+                % output_filename_ % strerror(errno));
+        output_failed_ = true;
+        return;
+    }
+    output_pos_ += size;
+    cache_.Write(output_pos_);
+}
+
 template <typename Block>
 void BlockFileWritePolicy<Block>::FileClose()
 {
-    if (ofs_.is_open()) {
-        ofs_.close();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        cache_.Close(output_pos_);
     }
 }
 
@@ -0,0 +1,272 @@
+#ifndef BLOCK_FORECAST_MEMORY_HPP
+#define BLOCK_FORECAST_MEMORY_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <stack>
+#include <deque>
+#include <vector>
+#include <cassert>
+
+#include "block_types.hpp"
+
+namespace external_sort {
+namespace block {
+
+// Memory policy for input streams merged together: all streams of a merge
+// share one pool of blocks (read-ahead buffers). A free block goes to the
+// stream which runs out of data first, i.e. the one whose last read value
+// is the smallest (forecasting, Knuth vol. 3, 5.4.6). Each stream is
+// guaranteed at least one block, so the merge never starves.
+template <typename Block, typename Comparator>
+class BlockForecastMemoryPolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+    class BlockPool;
+    using BlockPoolPtr = std::shared_ptr<BlockPool>;
+
+    class BlockPool /*: boost::noncopyable*/ {
+      public:
+        BlockPool(size_t memsize, size_t memblocks);
+        ~BlockPool();
+
+      public:
+        size_t Register();
+        size_t Allocated() const;
+        BlockPtr Allocate(size_t id);
+        BlockPtr TryAllocate(size_t id);    // nullptr if not its turn
+        void Free(size_t id, BlockPtr block);
+        const std::vector<BlockPtr>& Blocks() const { return all_; }
+        void Forecast(size_t id, const BlockPtr& block);
+
+      private:
+        // a stream sharing the pool
+        struct Client {
+            size_t blocks = 0;          // blocks held (queued or in use)
+            bool waiting = {false};     // waiting for a block
+            bool done = {false};        // no more blocks to read
+            bool has_key = {false};
+            ValueType key;              // last value read
+            std::condition_variable cv; // notifies about the turn to allocate
+        };
+        size_t Next() const;
+        void NotifyNext();
+
+      private:
+        TRACEX_NAME("BlockForecastPool");
+        mutable std::mutex mtx_;
+        std::stack<BlockPtr> pool_;
+        std::vector<BlockPtr> all_;     // all blocks of the pool
+        std::deque<Client> clients_;
+        size_t blocks_;
+        size_t blocks_allocated_;
+        Comparator comp_;
+    };
+
+    inline size_t Allocated() const { return mem_pool_->Allocated(); }
+    inline BlockPtr Allocate() { return mem_pool_->Allocate(id_); }
+    inline BlockPtr TryAllocate() { return mem_pool_->TryAllocate(id_); }
+    inline const std::vector<BlockPtr>& Blocks() const {
+        return mem_pool_->Blocks();
+    }
+    inline void Free(BlockPtr block) { mem_pool_->Free(id_, block); }
+    inline void Forecast(const BlockPtr& block) {
+        mem_pool_->Forecast(id_, block);
+    }
+
+    BlockPoolPtr mem_pool() { return mem_pool_; }
+    void set_mem_pool(BlockPoolPtr pool) {
+        mem_pool_ = pool;
+        id_ = mem_pool_->Register();
+    };
+
+  private:
+    BlockPoolPtr mem_pool_ = {nullptr};
+    size_t id_ = 0;
+};
+
+template <typename Block, typename Comparator>
+BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::BlockPool(
+    size_t memsize, size_t memblocks)
+    : blocks_(memblocks),
+      blocks_allocated_(0)
+{
+    TRACEX(("new block pool: memsize %d, memblocks %d")
+           % memsize % memblocks);
+
+    size_t block_size = block_capacity<Block>(memsize / memblocks);
+
+    // pre-allocate a pool of blocks
+    while (pool_.size() < blocks_) {
+        BlockPtr block(new Block);
+        block->reserve(block_size);
+        pool_.push(block);
+        all_.push_back(block);
+        TRACEX(("new block %014p added to the pool")
+               % BlockTraits<Block>::RawPtr(block));
+    }
+}
+
+template <typename Block, typename Comparator>
+BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::~BlockPool()
+{
+    TRACEX(("deleting block pool"));
+
+    // free all blocks from the pool
+    while (!pool_.empty()) {
+        BlockPtr block = pool_.top();
+        TRACEX(("deleting block %014p from the pool")
+               % BlockTraits<Block>::RawPtr(block));
+        BlockTraits<Block>::DeletePtr(block);
+        pool_.pop();
+    }
+    assert(blocks_allocated_ == 0);
+}
+
+template <typename Block, typename Comparator>
+size_t BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Register()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    clients_.emplace_back();
+    return clients_.size() - 1;
+}
+
+template <typename Block, typename Comparator>
+size_t BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Allocated()
+    const
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    return blocks_allocated_;
+}
+
+template <typename Block, typename Comparator>
+size_t BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Next() const
+{
+    // Picks the waiting stream to get the next free block:
+    // 1) A stream without blocks gets one first (it blocks the merge)
+    // 2) Otherwise, the stream with the smallest last read value, as long as
+    //    enough blocks are left for the streams without blocks yet
+    size_t next = clients_.size();
+    size_t reserved = 0;
+    for (size_t i = 0; i < clients_.size(); i++) {
+        const Client& c = clients_[i];
+        if (c.waiting && c.blocks == 0) {
+            return i;
+        }
+        if (!c.done && c.blocks == 0) {
+            reserved++;
+        } else if (c.waiting &&
+                   (next == clients_.size() || !clients_[next].has_key ||
+                    (c.has_key && comp_(c.key, clients_[next].key)))) {
+            next = i;
+        }
+    }
+    return (pool_.size() > reserved) ? next : clients_.size();
+}
+
+template <typename Block, typename Comparator>
+void BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::NotifyNext()
+{
+    // wake up only the stream whose turn it is (if any)
+    if (!pool_.empty()) {
+        size_t next = Next();
+        if (next < clients_.size()) {
+            clients_[next].cv.notify_one();
+        }
+    }
+}
+
+template <typename Block, typename Comparator>
+auto BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Allocate(
+    size_t id) -> BlockPtr
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    TRACEX(("allocating block for stream %d...") % id);
+
+    // wait for a free block and for the turn of this stream
+    clients_[id].waiting = true;
+    while (pool_.empty() || Next() != id) {
+        clients_[id].cv.wait(lck);
+    }
+    clients_[id].waiting = false;
+    clients_[id].blocks++;
+
+    BlockPtr block = pool_.top();
+    pool_.pop();
+
+    blocks_allocated_++;
+    TRACEX(("block %014p allocated for stream %d (%s/%s), cap = %s")
+           % BlockTraits<Block>::RawPtr(block) % id
+           % blocks_allocated_ % blocks_ % block->capacity());
+
+    // another stream may be the next one now
+    NotifyNext();
+    return block;
+}
+
+template <typename Block, typename Comparator>
+auto BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::TryAllocate(
+    size_t id) -> BlockPtr
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+
+    // a free block, if this stream would be the next to get it
+    clients_[id].waiting = true;
+    bool turn = !pool_.empty() && Next() == id;
+    clients_[id].waiting = false;
+    if (!turn) {
+        return nullptr;
+    }
+    clients_[id].blocks++;
+
+    BlockPtr block = pool_.top();
+    pool_.pop();
+
+    blocks_allocated_++;
+    TRACEX(("block %014p allocated for stream %d (%s/%s), cap = %s")
+           % BlockTraits<Block>::RawPtr(block) % id
+           % blocks_allocated_ % blocks_ % block->capacity());
+    NotifyNext();
+    return block;
+}
+
+template <typename Block, typename Comparator>
+void BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Free(
+    size_t id, BlockPtr block)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    blocks_allocated_--;
+    clients_[id].blocks--;
+
+    // return the block back to the pool
+    block->resize(0);
+    pool_.push(block);
+
+    TRACEX(("block %014p deallocated by stream %d (%s/%s)")
+           % BlockTraits<Block>::RawPtr(block) % id
+           % blocks_allocated_ % blocks_);
+    NotifyNext();
+}
+
+template <typename Block, typename Comparator>
+void BlockForecastMemoryPolicy<Block, Comparator>::BlockPool::Forecast(
+    size_t id, const BlockPtr& block)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (block) {
+        // the stream runs out of data when its last read value is merged
+        clients_[id].key = block->back();
+        clients_[id].has_key = true;
+    } else {
+        // the stream is over
+        clients_[id].done = true;
+    }
+    NotifyNext();
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
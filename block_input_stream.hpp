@@ -6,6 +6,7 @@
 #include <thread>
 #include <atomic>
 #include <queue>
+#include <type_traits>
 
 #include "block_types.hpp"
 
@@ -29,11 +30,19 @@ class BlockInputStream : public ReadPolicy, public MemoryPolicy
     BlockPtr FrontBlock();  // get entire block
     BlockPtr ReadBlock();   // read a block right from the file
 
+    Iterator FrontBegin();  // get the values left in the current block
+    Iterator FrontEnd();    //   as a range [FrontBegin, FrontEnd)
+
     void Pop();
+    void Pop(Iterator last);  // pop the values up to last (current block)
     void PopBlock();
 
   private:
     void InputLoop();
+    void ReadLoop(std::false_type);    // one block at a time
+    void ReadLoop(std::true_type);     // several blocks in flight
+    BlockPtr ReadDone(BlockPtr block);
+    void QueueBlock(BlockPtr block);
     void WaitForBlock();
 
   private:
@@ -48,6 +57,7 @@ class BlockInputStream : public ReadPolicy, public MemoryPolicy
 
     std::thread tinput_;
     std::atomic<bool> empty_ = {false};
+    std::atomic<bool> closed_ = {false};
 };
 
 template <typename Block, typename ReadPolicy, typename MemoryPolicy>
@@ -56,6 +66,7 @@ void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::Open()
     TRACEX_METHOD();
     ReadPolicy::Open();
     empty_ = false;
+    closed_ = false;
     tinput_ = std::thread(&BlockInputStream::InputLoop, this);
 }
 
@@ -63,8 +74,10 @@ template <typename Block, typename ReadPolicy, typename MemoryPolicy>
 void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::Close()
 {
     TRACEX_METHOD();
-    ReadPolicy::Close();
+    // the input thread stops reading before the file is closed
+    closed_ = true;
     tinput_.join();
+    ReadPolicy::Close();
 }
 
 template <typename Block, typename ReadPolicy, typename MemoryPolicy>
@@ -99,6 +112,38 @@ void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::Pop()
     }
 }
 
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::Pop(Iterator last)
+{
+    // Empty() must be called first!
+
+    block_iter_ = last;
+    if (block_iter_ == block_->end()) {
+        // block is over, free it
+        auto tmp = block_;
+        PopBlock();
+        MemoryPolicy::Free(tmp);
+    }
+}
+
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::FrontBegin()
+    -> Iterator
+{
+    // Empty() must be called first!
+
+    return block_iter_;
+}
+
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::FrontEnd()
+    -> Iterator
+{
+    // Empty() must be called first!
+
+    return block_->end();
+}
+
 template <typename Block, typename ReadPolicy, typename MemoryPolicy>
 auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::FrontBlock()
     -> BlockPtr
@@ -119,19 +164,11 @@ void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::InputLoop()
 {
     TRACEX_METHOD();
 
-    while (!ReadPolicy::Empty()) {
-        // Allocate and read the block from the file (blocking!)
-        BlockPtr block = ReadBlock();
-
-        // push the block to the queue
-        if (block) {
-            std::unique_lock<std::mutex> lck(mtx_);
-            blocks_queue_.push(block);
-            TRACEX(("block %014p => input queue (%d)")
-                   % BlockTraits<Block>::RawPtr(block) % blocks_queue_.size());
-            cv_.notify_one();
-        }
-    }
+    ReadLoop(std::integral_constant<
+              bool, (AsyncDepth<ReadPolicy>::value > 0)>());
+
+    // no more blocks from this stream
+    MemoryPolicy::Forecast(nullptr);
 
     // empty_ needed, since ReadPolicy::Empty() becomes true before
     // the last block pushed into the queue
@@ -141,6 +178,63 @@ void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::InputLoop()
     cv_.notify_one();
 }
 
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::ReadLoop(
+    std::false_type)
+{
+    while (!closed_ && !ReadPolicy::Empty()) {
+        // Allocate and read the block from the file (blocking!)
+        QueueBlock(ReadBlock());
+    }
+}
+
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::ReadLoop(
+    std::true_type)
+{
+    // the pool blocks are the read buffers of the policy
+    ReadPolicy::Register(MemoryPolicy::Blocks());
+
+    while (ReadPolicy::InFlight() || (!closed_ && !ReadPolicy::Empty())) {
+        // submit the next blocks: waits for a free block only if none is
+        // in flight, the others are taken only if they are free already
+        while (!closed_ && !ReadPolicy::Empty() &&
+               ReadPolicy::InFlight() < AsyncDepth<ReadPolicy>::value) {
+            BlockPtr block = ReadPolicy::InFlight()
+                                 ? MemoryPolicy::TryAllocate()
+                                 : MemoryPolicy::Allocate();
+            if (!block) {
+                break;
+            }
+            ReadPolicy::Submit(block);
+        }
+
+        // wait for the oldest one
+        if (ReadPolicy::InFlight()) {
+            BlockPtr block = ReadPolicy::Complete();
+            if (closed_) {
+                MemoryPolicy::Free(block);
+            } else {
+                QueueBlock(ReadDone(block));
+            }
+        }
+    }
+}
+
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+void BlockInputStream<Block, ReadPolicy, MemoryPolicy>::QueueBlock(
+    BlockPtr block)
+{
+    // push the block to the queue
+    if (block) {
+        std::unique_lock<std::mutex> lck(mtx_);
+        blocks_queue_.push(block);
+        TRACEX(("block %014p => input queue (%d)")
+               % BlockTraits<Block>::RawPtr(block) % blocks_queue_.size());
+        cv_.notify_one();
+    }
+}
+
 template <typename Block, typename ReadPolicy, typename MemoryPolicy>
 auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::ReadBlock()
     -> BlockPtr
@@ -151,12 +245,22 @@ auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::ReadBlock()
 
     // read (fill in) the block from the input source
     ReadPolicy::Read(block);
+    return ReadDone(block);
+}
+
+template <typename Block, typename ReadPolicy, typename MemoryPolicy>
+auto BlockInputStream<Block, ReadPolicy, MemoryPolicy>::ReadDone(
+    BlockPtr block) -> BlockPtr
+{
     if (block->empty()) {
         // this happens when the previous block ended right before EOF
         TRACEX(("block %014p is empty, ignoring")
                % BlockTraits<Block>::RawPtr(block));
         MemoryPolicy::Free(block);
         block = nullptr;
+    } else {
+        // let the memory policy know what has been read
+        MemoryPolicy::Forecast(block);
     }
 
     return block;
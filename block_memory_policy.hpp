@@ -5,6 +5,7 @@
 #include <mutex>
 #include <atomic>
 #include <stack>
+#include <vector>
 #include <cassert>
 
 #include "block_types.hpp"
@@ -28,13 +29,16 @@ class BlockMemoryPolicy
       public:
         size_t Allocated() const;
         BlockPtr Allocate();
+        BlockPtr TryAllocate();         // nullptr if no block is free
         void Free(BlockPtr block);
+        const std::vector<BlockPtr>& Blocks() const { return all_; }
 
       private:
         TRACEX_NAME("BlockPool");
         mutable std::mutex mtx_;
         std::condition_variable cv_;
         std::stack<BlockPtr> pool_;
+        std::vector<BlockPtr> all_;     // all blocks of the pool
         size_t blocks_;
         size_t blocks_cnt_;
         size_t blocks_allocated_;
@@ -42,7 +46,12 @@ class BlockMemoryPolicy
 
     inline size_t Allocated() const { return mem_pool_->Allocated(); }
     inline BlockPtr Allocate() { return mem_pool_->Allocate(); }
+    inline BlockPtr TryAllocate() { return mem_pool_->TryAllocate(); }
+    inline const std::vector<BlockPtr>& Blocks() const {
+        return mem_pool_->Blocks();
+    }
     inline void Free(BlockPtr block) { mem_pool_->Free(block); }
+    inline void Forecast(const BlockPtr&) {}  // blocks aren't shared
 
     BlockPoolPtr mem_pool() { return mem_pool_; }
     void set_mem_pool(size_t memsize, size_t memblocks) {
@@ -64,14 +73,14 @@ BlockMemoryPolicy<Block>::BlockPool::BlockPool(size_t memsize,
     TRACEX(("new block pool: memsize %d, memblocks %d")
            % memsize % memblocks);
 
-    size_t block_size = memsize / memblocks /
-                        (sizeof(typename BlockTraits<Block>::ValueType));
+    size_t block_size = block_capacity<Block>(memsize / memblocks);
 
     // pre-allocate a pool of blocks
     while (pool_.size() < blocks_) {
         BlockPtr block(new Block);
         block->reserve(block_size);
         pool_.push(block);
+        all_.push_back(block);
         TRACEX(("new block %014p added to the pool")
                % BlockTraits<Block>::RawPtr(block));
     }
@@ -122,6 +131,24 @@ auto BlockMemoryPolicy<Block>::BlockPool::Allocate()
     return block;
 }
 
+template <typename Block>
+auto BlockMemoryPolicy<Block>::BlockPool::TryAllocate()
+    -> BlockPtr
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (pool_.empty()) {
+        return nullptr;
+    }
+    BlockPtr block = pool_.top();
+    pool_.pop();
+
+    blocks_allocated_++;
+    TRACEX(("block %014p allocated (%s/%s), cap = %s")
+           % BlockTraits<Block>::RawPtr(block)
+           % blocks_allocated_ % blocks_ % block->capacity());
+    return block;
+}
+
 template <typename Block>
 void BlockMemoryPolicy<Block>::BlockPool::Free(BlockPtr block)
 {
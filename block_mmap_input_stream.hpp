@@ -0,0 +1,249 @@
+#ifndef BLOCK_MMAP_INPUT_STREAM_HPP
+#define BLOCK_MMAP_INPUT_STREAM_HPP
+
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "block_types.hpp"
+#include "block_file_cache.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockMmapInputStream
+
+// Input stream of a merge reading a memory mapped file in place: the values
+// are handed over to the merge as views of the mapping (no read calls, no
+// blocks and no copies). The mapping is walked in windows of the size the
+// stream's blocks would have: the kernel is told to read ahead the next
+// window (MADV_WILLNEED) and to unmap the pages behind (MADV_DONTNEED), so
+// the resident part of the mapping stays within the stream's share of the
+// merge memory. Same interface as the BlockInputStream of a merge
+template <typename Block>
+class BlockMmapInputStream
+{
+  public:
+    using BlockType = Block;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+    using Iterator  = const ValueType*;
+
+    // The streams of a merge share no blocks; the pool only tells
+    // the window size (the size of a block of the pool)
+    class BlockPool {
+      public:
+        BlockPool(size_t memsize, size_t memblocks)
+            : block_size_(memsize / std::max<size_t>(memblocks, 1)) {}
+        size_t block_size() const { return block_size_; }
+
+      private:
+        size_t block_size_;
+    };
+    using BlockPoolPtr = std::shared_ptr<BlockPool>;
+
+    BlockMmapInputStream() = default;
+    BlockMmapInputStream(const BlockMmapInputStream&) = delete;
+    BlockMmapInputStream& operator=(const BlockMmapInputStream&) = delete;
+    ~BlockMmapInputStream() { Close(); }
+
+    void Open();
+    void Close();
+    bool Empty() const { return pos_ == end_; }
+
+    const ValueType& Front() const { return *pos_; }  // get a single value
+
+    Iterator FrontBegin() const { return pos_; }  // get the values left
+    Iterator FrontEnd() const { return wend_; }   //   in the current window
+
+    void Pop();
+    void Pop(Iterator last);  // pop the values up to last (current window)
+
+    /// Set/get properties
+    void set_mem_pool(BlockPoolPtr pool) { window_ = pool->block_size(); }
+
+    void set_input_filename(const std::string& ifn) { input_filename_ = ifn; }
+    const std::string& input_filename() const { return input_filename_; }
+
+    void set_input_rm_file(bool rm) { input_rm_file_ = rm; }
+    bool input_rm_file() const { return input_rm_file_; }
+
+    // reads only size bytes starting at offset (size = 0 - up to the end)
+    void set_input_range(size_t offset, size_t size) {
+        input_offset_ = offset;
+        input_size_ = size;
+    }
+
+    // drops the file from the page cache as it's read
+    void set_input_drop_cache(bool drop) { input_drop_cache_ = drop; }
+
+    // mapped runs are never encoded (read in place)
+    void set_input_encoded(bool) {}
+
+    // the file could not be opened or mapped
+    bool input_failed() const { return input_failed_; }
+
+  private:
+    void NextWindow();
+
+  private:
+    TRACEX_NAME("BlockMmapInputStream");
+
+    int fd_ = -1;
+    char* map_ = {nullptr};
+    size_t map_size_ = 0;
+    size_t map_offset_ = 0;             // file offset of the mapping
+    size_t map_done_ = 0;               // pages before are dropped already
+    size_t map_ahead_ = 0;              // pages before are read ahead already
+    size_t window_ = 0;                 // window size (bytes)
+    FileCache cache_;
+
+    const ValueType* pos_ = {nullptr};  // next value
+    const ValueType* wend_ = {nullptr}; // end of the current window
+    const ValueType* end_ = {nullptr};  // end of the input range
+
+    std::string input_filename_;
+    bool input_rm_file_ = {false};
+    size_t input_offset_ = 0;
+    size_t input_size_ = 0;
+    bool input_drop_cache_ = {false};
+    bool input_failed_ = {false};
+};
+
+template <typename Block>
+void BlockMmapInputStream<Block>::Open()
+{
+    TRACEX_METHOD();
+    LOG_INF(("opening file r %s (mmap)") % input_filename_);
+    TRACEX(("input file %s") % input_filename_);
+    pos_ = wend_ = end_ = nullptr;
+    input_failed_ = true;
+    fd_ = ::open(input_filename_.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        LOG_ERR(("Failed to open input file: %s") % input_filename_);
+        return;
+    }
+
+    // map the input range (starting at a page boundary)
+    size_t file_size = st.st_size;
+    size_t offset = std::min(input_offset_, file_size);
+    size_t end = input_size_ ? std::min(offset + input_size_, file_size)
+                             : file_size;
+    size_t cnt = (end - offset) / sizeof(ValueType);
+    const size_t page = sysconf(_SC_PAGESIZE);
+    map_offset_ = offset / page * page;
+    map_size_ = offset + cnt * sizeof(ValueType) - map_offset_;
+    if (cnt == 0) {
+        input_failed_ = false;
+        return;
+    }
+    if ((offset - map_offset_) % alignof(ValueType) != 0) {
+        LOG_ERR(("Input range of %s is not aligned to the values: %d")
+                % input_filename_ % offset);
+        return;
+    }
+    void* map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED,
+                     fd_, map_offset_);
+    if (map == MAP_FAILED) {
+        LOG_ERR(("Failed to map input file: %s") % input_filename_);
+        return;
+    }
+    map_ = static_cast<char*>(map);
+    input_failed_ = false;
+    madvise(map_, map_size_, MADV_SEQUENTIAL);
+    map_done_ = map_ahead_ = 0;
+    window_ = std::max(window_ / page * page, page);
+    if (input_drop_cache_) {
+        cache_.Open(input_filename_, offset, true);
+    }
+
+    pos_ = wend_ = reinterpret_cast<const ValueType*>(
+        map_ + (offset - map_offset_));
+    end_ = pos_ + cnt;
+    NextWindow();
+}
+
+template <typename Block>
+void BlockMmapInputStream<Block>::Close()
+{
+    if (map_) {
+        cache_.Close(map_offset_ + map_size_);
+        munmap(map_, map_size_);
+        map_ = nullptr;
+    }
+    pos_ = wend_ = end_ = nullptr;
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        if (input_rm_file_ && !input_failed_) {
+            if (remove(input_filename_.c_str()) != 0) {
+                LOG_ERR(("Failed to remove file: %s") % input_filename_);
+            }
+        }
+    }
+}
+
+template <typename Block>
+void BlockMmapInputStream<Block>::Pop()
+{
+    // Empty() must be called first!
+
+    if (++pos_ == wend_) {
+        NextWindow();
+    }
+}
+
+template <typename Block>
+void BlockMmapInputStream<Block>::Pop(Iterator last)
+{
+    // Empty() must be called first!
+
+    pos_ = last;
+    if (pos_ == wend_) {
+        NextWindow();
+    }
+}
+
+template <typename Block>
+void BlockMmapInputStream<Block>::NextWindow()
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t pos = reinterpret_cast<const char*>(pos_) - map_;
+
+    // drop the pages read
+    size_t done = pos / page * page;
+    if (done > map_done_) {
+        madvise(map_ + map_done_, done - map_done_, MADV_DONTNEED);
+        map_done_ = done;
+    }
+    cache_.Read(map_offset_ + pos);
+
+    // the next window ends at a page boundary (or at the end of the range),
+    // the one after it is read ahead
+    size_t wend = std::min((pos + window_) / page * page, map_size_);
+    wend_ = std::min(end_, reinterpret_cast<const ValueType*>(
+        map_ + wend - (wend - pos) % sizeof(ValueType)));
+    if (wend_ == pos_) {
+        wend_ = std::min(end_, pos_ + 1);
+    }
+    size_t ahead = std::min(map_size_, wend + window_);
+    if (ahead > map_ahead_) {
+        size_t from = std::max(map_ahead_, done);
+        madvise(map_ + from, ahead - from, MADV_WILLNEED);
+        map_ahead_ = ahead;
+    }
+    TRACEX(("window %d..%d of %s")
+           % pos % (reinterpret_cast<const char*>(wend_) - map_)
+           % input_filename_);
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -2,10 +2,13 @@
 #define BLOCK_OUTPUT_STREAM_HPP
 
 #include <condition_variable>
+#include <algorithm>
+#include <iterator>
 #include <mutex>
 #include <thread>
 #include <atomic>
 #include <queue>
+#include <type_traits>
 
 #include "block_types.hpp"
 
@@ -25,11 +28,15 @@ class BlockOutputStream : public WritePolicy, public MemoryPolicy
     void Close();
 
     void Push(const ValueType& value);  // push a single value
+    template <typename InputIterator>   // push a range of values
+    void Push(InputIterator first, InputIterator last);
     void PushBlock(BlockPtr block);     // push entire block
     void WriteBlock(BlockPtr block);    // write a block directly into a file
 
   private:
     void OutputLoop();
+    void WriteLoop(std::false_type);    // one block at a time
+    void WriteLoop(std::true_type);     // several blocks in flight
 
   private:
     TRACEX_NAME("BlockOutputStream");
@@ -82,6 +89,31 @@ void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::Push(
     }
 }
 
+template <typename Block, typename WritePolicy, typename MemoryPolicy>
+template <typename InputIterator>
+void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::Push(
+    InputIterator first, InputIterator last)
+{
+    while (first != last) {
+        if (!block_) {
+            block_ = MemoryPolicy::Allocate();
+        }
+        // copy as much as fits into the current block (at least one value)
+        size_t n = std::max<size_t>(block_->capacity() - block_->size(), 1);
+        n = std::min<size_t>(n, std::distance(first, last));
+        auto next = first;
+        std::advance(next, n);
+        block_->insert(block_->end(), first, next);
+        first = next;
+
+        if (block_->size() == block_->capacity()) {
+            // block is full, push it to the output queue
+            PushBlock(block_);
+            block_ = nullptr;
+        }
+    }
+}
+
 template <typename Block, typename WritePolicy, typename MemoryPolicy>
 void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::PushBlock(
     BlockPtr block)
@@ -99,6 +131,14 @@ template <typename Block, typename WritePolicy, typename MemoryPolicy>
 void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::OutputLoop()
 {
     TRACEX_METHOD();
+    WriteLoop(std::integral_constant<
+              bool, (AsyncDepth<WritePolicy>::value > 0)>());
+}
+
+template <typename Block, typename WritePolicy, typename MemoryPolicy>
+void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::WriteLoop(
+    std::false_type)
+{
     for (;;) {
     //while (!stopped_ || MemoryPolicy::Allocated()) {
 
@@ -124,6 +164,51 @@ void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::OutputLoop()
     }
 }
 
+template <typename Block, typename WritePolicy, typename MemoryPolicy>
+void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::WriteLoop(
+    std::true_type)
+{
+    // the pool blocks are the write buffers of the policy
+    WritePolicy::Register(MemoryPolicy::Blocks());
+
+    for (;;) {
+        // wait for a block in the queue or the stop-flag; meanwhile
+        // the written blocks are freed (the pushing thread may wait for them)
+        std::unique_lock<std::mutex> lck(mtx_);
+        while (blocks_queue_.empty() && !stopped_) {
+            if (WritePolicy::InFlight()) {
+                lck.unlock();
+                MemoryPolicy::Free(WritePolicy::Complete());
+                lck.lock();
+            } else {
+                cv_.wait(lck);
+            }
+        }
+
+        if (!blocks_queue_.empty()) {
+            BlockPtr block = blocks_queue_.front();
+            blocks_queue_.pop();
+            TRACEX(("block %014p <= output queue (%d)")
+                   % BlockTraits<Block>::RawPtr(block) % blocks_queue_.size());
+            lck.unlock();
+
+            // submit the block, once there is room for it
+            if (WritePolicy::InFlight() == AsyncDepth<WritePolicy>::value) {
+                MemoryPolicy::Free(WritePolicy::Complete());
+            }
+            WritePolicy::Submit(block);
+        } else if (stopped_) {
+            // nothing left in the queue and the stop flag is set =>
+            // wait for the blocks in flight and quit
+            lck.unlock();
+            while (WritePolicy::InFlight()) {
+                MemoryPolicy::Free(WritePolicy::Complete());
+            }
+            break;
+        }
+    }
+}
+
 template <typename Block, typename WritePolicy, typename MemoryPolicy>
 void BlockOutputStream<Block, WritePolicy, MemoryPolicy>::WriteBlock(
     BlockPtr block)
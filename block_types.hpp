@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <memory>
+#include <cstddef>
+#include <type_traits>
 
 namespace external_sort {
 namespace block {
@@ -29,6 +31,47 @@ struct BlockTraits
     using ValueType = typename Container::value_type;
 };
 
+// Alignment of the block size (in bytes) the pool keeps to, e.g. for
+// the blocks read and written directly (see DirectBlock)
+template <typename BlockType>
+struct BlockAlign
+{
+    static const size_t value = 1;
+};
+
+// Number of blocks a read/write policy keeps in flight. A policy with
+// asynchronous i/o declares ASYNC_DEPTH and implements Submit(block),
+// Complete() (returns the oldest block submitted, done), InFlight() and
+// Register(blocks of the pool); the streams then keep up to ASYNC_DEPTH
+// blocks in flight instead of reading/writing one block at a time
+template <typename Policy, typename Enable = void>
+struct AsyncDepth
+{
+    static const size_t value = 0;
+};
+
+template <typename Policy>
+struct AsyncDepth<Policy, typename std::enable_if<
+                              (Policy::ASYNC_DEPTH > 0)>::type>
+{
+    static const size_t value = Policy::ASYNC_DEPTH;
+};
+
+// number of values in a pool block of (at most) the given size in bytes
+template <typename BlockType>
+size_t block_capacity(size_t bytes)
+{
+    using ValueType = typename BlockTraits<BlockType>::ValueType;
+    size_t align = BlockAlign<BlockType>::value;
+    while (align % sizeof(ValueType)) {
+        align += BlockAlign<BlockType>::value;
+    }
+    if (bytes >= align) {
+        bytes = bytes / align * align;
+    }
+    return bytes / sizeof(ValueType);
+}
+
 } // namespace block
 } // namespace external_sort
 
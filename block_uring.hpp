@@ -0,0 +1,340 @@
+#ifndef BLOCK_URING_HPP
+#define BLOCK_URING_HPP
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <cerrno>
+#include <sys/uio.h>
+
+#include "block_direct_file.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define EXTERNAL_SORT_HAVE_URING
+#endif
+#endif
+
+namespace external_sort {
+namespace block {
+
+// max number of blocks in flight per stream (one request per block)
+const size_t URING_DEPTH = 8;
+
+/// ----------------------------------------------------------------------------
+/// IoRing
+
+// Minimal io_uring (no liburing needed): requests are queued, submitted at
+// once and reaped one by one as they complete, so the caller keeps several
+// of them in flight. Requests into the registered buffers (the pool blocks)
+// use the fixed-buffer opcodes. Without io_uring (old kernel, other platform,
+// seccomp), or if the submission fails, the requests are executed
+// synchronously and complete right away
+class IoRing
+{
+  public:
+    IoRing() = default;
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    ~IoRing() { Exit(); }
+
+    bool Init(unsigned depth);
+    void Exit();
+
+    // registers the buffers (replacing the ones registered before);
+    // returns false if they can't be (the requests use plain buffers then)
+    bool Register(const std::vector<struct iovec>& bufs);
+
+    // queues a request; its completion returns the tag and
+    // the result (bytes or -errno)
+    void Queue(bool write, int fd, const char* buf, size_t size,
+               size_t offset, uint64_t tag);
+
+    // submits the queued requests
+    void Submit();
+
+    // returns the next completion (waits for it, if needed);
+    // there must be a request submitted and not completed yet
+    void Complete(uint64_t& tag, ssize_t& res);
+
+  private:
+    struct Request {
+        bool write;
+        int fd;
+        const char* buf;
+        size_t size;
+        size_t offset;
+        uint64_t tag;
+    };
+
+    // executes the request synchronously
+    void Execute(const Request& r);
+
+    // index of the registered buffer holding the range (-1 if none)
+    int BufferIndex(const char* buf, size_t size) const;
+
+  private:
+    std::vector<Request> queued_;                     // not submitted yet
+    std::deque<std::pair<uint64_t, ssize_t>> done_;   // sync completions
+    std::vector<struct iovec> bufs_;                  // registered buffers
+#ifdef EXTERNAL_SORT_HAVE_URING
+    int fd_ = -1;
+    size_t inflight_ = 0;
+    void* sq_ptr_ = {nullptr};
+    void* cq_ptr_ = {nullptr};
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    struct io_uring_sqe* sqes_ = {nullptr};
+    size_t sqes_size_ = 0;
+    unsigned* sq_tail_ = {nullptr};
+    unsigned* sq_mask_ = {nullptr};
+    unsigned* sq_array_ = {nullptr};
+    unsigned* cq_head_ = {nullptr};
+    unsigned* cq_tail_ = {nullptr};
+    unsigned* cq_mask_ = {nullptr};
+    struct io_uring_cqe* cqes_ = {nullptr};
+#endif
+};
+
+inline void IoRing::Execute(const Request& r)
+{
+    ssize_t res = r.write ? ::pwrite(r.fd, r.buf, r.size, r.offset)
+                          : ::pread(r.fd, const_cast<char*>(r.buf),
+                                    r.size, r.offset);
+    done_.emplace_back(r.tag, res < 0 ? -errno : res);
+}
+
+inline int IoRing::BufferIndex(const char* buf, size_t size) const
+{
+    for (size_t i = 0; i < bufs_.size(); i++) {
+        const char* base = static_cast<const char*>(bufs_[i].iov_base);
+        if (buf >= base && buf + size <= base + bufs_[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+inline void IoRing::Queue(bool write, int fd, const char* buf, size_t size,
+                          size_t offset, uint64_t tag)
+{
+    queued_.push_back(Request{write, fd, buf, size, offset, tag});
+}
+
+#ifdef EXTERNAL_SORT_HAVE_URING
+
+inline bool IoRing::Init(unsigned depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd_ < 0) {
+        LOG_INF(("no io_uring, synchronous i/o"));
+        return false;
+    }
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+        LOG_ERR(("Failed to map io_uring"));
+        sq_ptr_ = (sq_ptr_ == MAP_FAILED) ? nullptr : sq_ptr_;
+        cq_ptr_ = (cq_ptr_ == MAP_FAILED) ? nullptr : cq_ptr_;
+        sqes_ = (sqes == MAP_FAILED) ? nullptr
+                                     : static_cast<io_uring_sqe*>(sqes);
+        Exit();
+        return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+inline void IoRing::Exit()
+{
+    // the requests in flight must be reaped before the ring is gone
+    uint64_t tag;
+    ssize_t res;
+    while (fd_ >= 0 && inflight_) {
+        Complete(tag, res);
+    }
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+        sqes_ = nullptr;
+    }
+    if (cq_ptr_) {
+        munmap(cq_ptr_, cq_size_);
+        cq_ptr_ = nullptr;
+    }
+    if (sq_ptr_) {
+        munmap(sq_ptr_, sq_size_);
+        sq_ptr_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    bufs_.clear();
+    done_.clear();
+}
+
+inline bool IoRing::Register(const std::vector<struct iovec>& bufs)
+{
+    if (fd_ < 0 || inflight_) {
+        return false;
+    }
+    if (!bufs_.empty()) {
+        syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS,
+                nullptr, 0);
+        bufs_.clear();
+    }
+    if (bufs.empty() ||
+        syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                bufs.data(), unsigned(bufs.size())) != 0) {
+        LOG_INF(("io_uring buffers not registered (%s)") % strerror(errno));
+        return false;
+    }
+    bufs_ = bufs;
+    return true;
+}
+
+inline void IoRing::Submit()
+{
+    if (fd_ < 0) {
+        for (const auto& r : queued_) {
+            Execute(r);
+        }
+        queued_.clear();
+        return;
+    }
+
+    unsigned tail = *sq_tail_;
+    for (const auto& r : queued_) {
+        unsigned index = (tail++) & *sq_mask_;
+        struct io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        int buf_index = BufferIndex(r.buf, r.size);
+        if (buf_index >= 0) {
+            sqe->opcode = r.write ? IORING_OP_WRITE_FIXED
+                                  : IORING_OP_READ_FIXED;
+            sqe->buf_index = buf_index;
+        } else {
+            sqe->opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd = r.fd;
+        sqe->off = r.offset;
+        sqe->addr = reinterpret_cast<uint64_t>(r.buf);
+        sqe->len = r.size;
+        sqe->user_data = r.tag;
+        sq_array_[index] = index;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    size_t submitted = 0;
+    while (submitted < queued_.size()) {
+        int n = syscall(__NR_io_uring_enter, fd_,
+                        unsigned(queued_.size() - submitted), 0, 0,
+                        nullptr, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // the kernel hasn't taken the rest: take them back from the
+            // submission queue and execute them synchronously
+            LOG_ERR(("Failed to submit io_uring requests, "
+                     "synchronous i/o (%s)") % strerror(errno));
+            __atomic_store_n(sq_tail_,
+                             unsigned(tail - (queued_.size() - submitted)),
+                             __ATOMIC_RELEASE);
+            for (size_t i = submitted; i < queued_.size(); i++) {
+                Execute(queued_[i]);
+            }
+            break;
+        }
+        submitted += n;
+        inflight_ += n;
+    }
+    queued_.clear();
+}
+
+inline void IoRing::Complete(uint64_t& tag, ssize_t& res)
+{
+    if (!done_.empty() || !inflight_) {
+        tag = done_.front().first;
+        res = done_.front().second;
+        done_.pop_front();
+        return;
+    }
+
+    unsigned head = *cq_head_;
+    while (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0);
+    }
+    const struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+    tag = cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    inflight_--;
+}
+
+#else
+
+inline bool IoRing::Init(unsigned)
+{
+    LOG_INF(("no io_uring, synchronous i/o"));
+    return false;
+}
+
+inline void IoRing::Exit()
+{
+    done_.clear();
+}
+
+inline bool IoRing::Register(const std::vector<struct iovec>&)
+{
+    return false;
+}
+
+inline void IoRing::Submit()
+{
+    for (const auto& r : queued_) {
+        Execute(r);
+    }
+    queued_.clear();
+}
+
+inline void IoRing::Complete(uint64_t& tag, ssize_t& res)
+{
+    tag = done_.front().first;
+    res = done_.front().second;
+    done_.pop_front();
+}
+
+#endif
+
+} // namespace block
+} // namespace external_sort
+
+#endif
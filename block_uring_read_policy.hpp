@@ -0,0 +1,288 @@
+#ifndef BLOCK_URING_READ_HPP
+#define BLOCK_URING_READ_HPP
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "block_types.hpp"
+#include "block_direct_file.hpp"
+#include "block_uring.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockUringReadPolicy
+
+// Drop-in replacement of BlockFileReadPolicy reading the file (O_DIRECT)
+// through io_uring: the aligned part of the file holding the values of a
+// block is read straight into the block (DirectBlock, aligned memory).
+// The reads are asynchronous (see BlockInputStream): the stream submits
+// the next free pool blocks, up to ASYNC_DEPTH of them are in flight at
+// once, and takes them back as they complete, oldest first. The pool
+// blocks are registered with the ring (fixed buffers), so the stream needs
+// no memory besides them (see BlockDirectReadPolicy for the rest)
+template <typename Block>
+class BlockUringReadPolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+
+    static_assert(BlockAlign<Block>::value % DIRECT_IO_ALIGN == 0,
+                  "direct i/o needs aligned blocks (DirectBlock)");
+
+    /// Policy interface
+    void Open();
+    void Close();
+    void Read(BlockPtr& block);
+    bool Empty() const;                 // nothing left to submit
+
+    /// Asynchronous reads
+    static const size_t ASYNC_DEPTH = URING_DEPTH;
+    void Register(const std::vector<BlockPtr>& blocks);
+    void Submit(BlockPtr block);        // starts reading the next values
+    BlockPtr Complete();                // waits for the oldest block
+    size_t InFlight() const { return inflight_.size(); }
+
+    /// Set/get properties
+    void set_input_filename(const std::string& ifn) { input_filename_ = ifn; }
+    const std::string& input_filename() const { return input_filename_; }
+
+    void set_input_rm_file(bool rm) { input_rm_file_ = rm; }
+    bool input_rm_file() const { return input_rm_file_; }
+
+    // reads only size bytes starting at offset (size = 0 - up to the end)
+    void set_input_range(size_t offset, size_t size) {
+        input_offset_ = offset;
+        input_size_ = size;
+    }
+
+    // the page cache is bypassed anyway
+    void set_input_drop_cache(bool) {}
+
+    // the file could not be opened or read (or shrank while being read)
+    bool input_failed() const { return input_failed_; }
+
+  private:
+    // a block being read
+    struct Request {
+        BlockPtr block;
+        size_t pos;                     // file offset of its values
+        size_t head;                    // bytes read before them (aligned)
+        size_t size;                    // bytes of the values to read
+        ssize_t res;                    // bytes read or -errno
+        bool done;
+    };
+
+    void FileOpen();
+    void FileClose();
+    void FileFail(const char* what);
+
+  private:
+    TRACEX_NAME("BlockUringReadPolicy");
+
+    int fd_ = -1;                       // direct descriptor
+    int fd_buffered_ = -1;              // buffered descriptor (small blocks)
+    IoRing ring_;
+    std::deque<Request> inflight_;
+    uint64_t tag_ = 0;                  // tag of the first request in flight
+    std::string input_filename_;
+    bool input_rm_file_ = {false};
+    size_t input_offset_ = 0;
+    size_t input_size_ = 0;
+    size_t input_pos_ = 0;              // next byte to read
+    size_t input_end_ = 0;              // end of the input range
+    bool input_failed_ = {false};
+    size_t block_cnt_ = 0;
+};
+
+/// ----------------------------------------------------------------------------
+/// Policy interface methods
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::Open()
+{
+    TRACEX_METHOD();
+    FileOpen();
+}
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::Close()
+{
+    TRACEX_METHOD();
+    FileClose();
+}
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::Read(BlockPtr& block)
+{
+    Submit(block);
+    block = Complete();
+}
+
+template <typename Block>
+bool BlockUringReadPolicy<Block>::Empty() const
+{
+    // (a failed read cuts the end below the next submission)
+    return fd_ < 0 || input_pos_ >= input_end_ ||
+           input_end_ - input_pos_ < sizeof(ValueType);
+}
+
+/// ----------------------------------------------------------------------------
+/// Asynchronous reads
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::Register(const std::vector<BlockPtr>& blocks)
+{
+    std::vector<struct iovec> bufs;
+    for (const auto& block : blocks) {
+        bufs.push_back({block->data(), block->capacity() * sizeof(ValueType)});
+    }
+    ring_.Register(bufs);
+}
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::Submit(BlockPtr block)
+{
+    block->resize(block->capacity());
+    char* data = reinterpret_cast<char*>(block->data());
+    size_t room = direct_align_down(block->capacity() * sizeof(ValueType));
+    size_t head = input_pos_ - direct_align_down(input_pos_);
+    size_t left = (input_end_ - input_pos_) / sizeof(ValueType) *
+                  sizeof(ValueType);
+
+    Request r = {block, input_pos_, head, 0, 0, false};
+    if (room > head) {
+        r.size = std::min(left, (room - head) / sizeof(ValueType) *
+                                sizeof(ValueType));
+    }
+    if (r.size) {
+        // the aligned part of the file holding the values
+        ring_.Queue(false, fd_, data, direct_align_up(head + r.size),
+                    input_pos_ - head, tag_ + inflight_.size());
+        ring_.Submit();
+    } else {
+        // a block too small for an aligned read
+        r.head = 0;
+        r.size = std::min(left, block->size() * sizeof(ValueType));
+        ssize_t n = file_pread(fd_buffered_, data, r.size, input_pos_);
+        r.res = (n < 0) ? -errno : n;
+        r.done = true;
+    }
+    input_pos_ += r.size;
+    inflight_.push_back(r);
+}
+
+template <typename Block>
+auto BlockUringReadPolicy<Block>::Complete() -> BlockPtr
+{
+    // reap the completions up to the one of the oldest block
+    while (!inflight_.front().done) {
+        uint64_t tag;
+        ssize_t res;
+        ring_.Complete(tag, res);
+        Request& r = inflight_[tag - tag_];
+        r.res = res;
+        r.done = true;
+    }
+    Request r = inflight_.front();
+    inflight_.pop_front();
+    tag_++;
+
+    ssize_t n = 0;
+    if (!input_failed_ && r.res >= 0) {
+        n = std::min<ssize_t>(std::max<ssize_t>(r.res - ssize_t(r.head), 0),
+                              r.size);
+    }
+    if (!input_failed_ && size_t(n) < r.size) {
+        // a read error or the file is shorter than it was
+        errno = r.res < 0 ? -r.res : 0;
+        FileFail("read");
+    }
+    if (input_failed_) {
+        // the values of the blocks submitted after a failed one would
+        // follow a gap: they are dropped with the rest of the input
+        n = 0;
+    } else if (r.head && n > 0) {
+        char* data = reinterpret_cast<char*>(r.block->data());
+        memmove(data, data + r.head, n);
+    }
+
+    r.block->resize(n / sizeof(ValueType));
+    block_cnt_++;
+    TRACEX(("block %014p <= file (%s), is_over = %s, size = %s")
+           % BlockTraits<Block>::RawPtr(r.block)
+           % block_cnt_ % Empty() % r.block->size());
+    return r.block;
+}
+
+/// ----------------------------------------------------------------------------
+/// File operations
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::FileOpen()
+{
+    LOG_INF(("opening file r %s (io_uring)") % input_filename_);
+    TRACEX(("input file %s") % input_filename_);
+    input_pos_ = input_end_ = 0;
+    inflight_.clear();
+    tag_ = 0;
+    fd_ = direct_open(input_filename_, O_RDONLY);
+    if (fd_ >= 0) {
+        fd_buffered_ = ::open(input_filename_.c_str(), O_RDONLY);
+        ring_.Init(URING_DEPTH);
+    }
+    struct stat st;
+    input_failed_ = false;
+    if (fd_ < 0 || fd_buffered_ < 0 || fstat(fd_, &st) != 0) {
+        FileFail("open");
+        return;
+    }
+
+    // the range is cut to the file size
+    size_t file_size = st.st_size;
+    input_pos_ = std::min(input_offset_, file_size);
+    input_end_ = input_size_ ? std::min(input_pos_ + input_size_, file_size)
+                             : file_size;
+}
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::FileClose()
+{
+    if (fd_buffered_ >= 0) {
+        ::close(fd_buffered_);
+        fd_buffered_ = -1;
+    }
+    ring_.Exit();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        if (input_rm_file_ && !input_failed_) {
+            if (remove(input_filename_.c_str()) != 0) {
+                LOG_ERR(("Failed to remove file: %s") % input_filename_);
+            }
+        }
+    }
+}
+
+template <typename Block>
+void BlockUringReadPolicy<Block>::FileFail(const char* what)
+{
+    LOG_ERR(("Failed to %s input file: %s (%s)") % what % input_filename_
+            % (errno ? strerror(errno) : "unexpected end of file"));
+    input_failed_ = true;
+    input_end_ = input_pos_;
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef BLOCK_URING_WRITE_HPP
+#define BLOCK_URING_WRITE_HPP
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <sys/uio.h>
+
+#include "block_types.hpp"
+#include "block_direct_file.hpp"
+#include "block_uring.hpp"
+
+namespace external_sort {
+namespace block {
+
+/// ----------------------------------------------------------------------------
+/// BlockUringWritePolicy
+
+// Drop-in replacement of BlockFileWritePolicy writing the file (O_DIRECT)
+// through io_uring: the aligned body of a block is written straight from
+// the block (DirectBlock, aligned memory). The writes are asynchronous (see
+// BlockOutputStream): the stream submits the blocks queued to be written,
+// up to ASYNC_DEPTH of them are in flight at once, and frees them as they
+// complete, oldest first. The pool blocks are registered with the ring
+// (fixed buffers). The unaligned head and tail of a block go through
+// a buffered descriptor (see BlockDirectWritePolicy)
+template <typename Block>
+class BlockUringWritePolicy
+{
+  public:
+    using BlockPtr = typename BlockTraits<Block>::BlockPtr;
+    using ValueType = typename BlockTraits<Block>::ValueType;
+
+    static_assert(BlockAlign<Block>::value % DIRECT_IO_ALIGN == 0,
+                  "direct i/o needs aligned blocks (DirectBlock)");
+
+    /// Policy interface
+    void Open();
+    void Close();
+    void Write(const BlockPtr& block);
+
+    /// Asynchronous writes
+    static const size_t ASYNC_DEPTH = URING_DEPTH;
+    void Register(const std::vector<BlockPtr>& blocks);
+    void Submit(const BlockPtr& block); // starts writing the block
+    BlockPtr Complete();                // waits for the oldest block
+    size_t InFlight() const { return inflight_.size(); }
+
+    /// Set/get properties
+    void set_output_filename(const std::string& ofn) { output_filename_ = ofn; }
+    const std::string& output_filename() const { return output_filename_; }
+
+    // writes into the existing file starting at offset (no truncation)
+    void set_output_offset(size_t offset) {
+        output_offset_ = offset;
+        output_inplace_ = true;
+    }
+
+    // the page cache is bypassed anyway
+    void set_output_drop_cache(bool) {}
+
+    // the file could not be opened or written
+    bool output_failed() const { return output_failed_; }
+
+  private:
+    // a block being written (its aligned body)
+    struct Request {
+        BlockPtr block;
+        const char* data;
+        size_t pos;                     // file offset of the body
+        size_t size;                    // bytes of the body
+        ssize_t res;                    // bytes written or -errno
+        bool done;
+    };
+
+    void FileOpen();
+    void FileWriteRange(int fd, const char* data, size_t size);
+    void FileClose();
+
+  private:
+    TRACEX_NAME("BlockUringWritePolicy");
+
+    int fd_ = -1;                       // direct descriptor
+    int fd_buffered_ = -1;              // buffered descriptor (unaligned i/o)
+    IoRing ring_;
+    std::deque<Request> inflight_;
+    uint64_t tag_ = 0;                  // tag of the first request in flight
+    size_t block_cnt_ = 0;
+    std::string output_filename_;
+    size_t output_offset_ = 0;
+    size_t output_pos_ = 0;             // next byte to write
+    bool output_inplace_ = {false};
+    bool output_failed_ = {false};
+};
+
+/// ----------------------------------------------------------------------------
+/// Policy interface methods
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::Open()
+{
+    TRACEX_METHOD();
+    FileOpen();
+}
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::Close()
+{
+    TRACEX_METHOD();
+    FileClose();
+}
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::Write(const BlockPtr& block)
+{
+    // egnore empty blocks
+    if (!block || block->empty()) {
+        return;
+    }
+
+    // write the block
+    Submit(block);
+    Complete();
+}
+
+/// ----------------------------------------------------------------------------
+/// Asynchronous writes
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::Register(
+    const std::vector<BlockPtr>& blocks)
+{
+    std::vector<struct iovec> bufs;
+    for (const auto& block : blocks) {
+        bufs.push_back({block->data(), block->capacity() * sizeof(ValueType)});
+    }
+    ring_.Register(bufs);
+}
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::Submit(const BlockPtr& block)
+{
+    char* data = reinterpret_cast<char*>(block->data());
+    size_t bsize = block->size() * sizeof(ValueType);
+
+    // unaligned head (up to an aligned offset)
+    size_t head = std::min(bsize, direct_align_up(output_pos_) - output_pos_);
+    FileWriteRange(fd_buffered_, data, head);
+
+    // aligned body
+    size_t body = direct_align_down(bsize - head);
+    if (body && head) {
+        memmove(data, data + head, bsize - head);
+    } else {
+        data += head;
+    }
+    if (output_failed_) {
+        // the rest of a failed output is dropped
+        body = 0;
+    }
+    Request r = {block, data, output_pos_, body, 0, !body};
+    if (body) {
+        ring_.Queue(true, fd_, data, body, output_pos_,
+                    tag_ + inflight_.size());
+        ring_.Submit();
+    }
+    inflight_.push_back(r);
+    output_pos_ += body;
+
+    // unaligned tail
+    FileWriteRange(fd_buffered_, data + body, bsize - head - body);
+}
+
+template <typename Block>
+auto BlockUringWritePolicy<Block>::Complete() -> BlockPtr
+{
+    // reap the completions up to the one of the oldest block
+    while (!inflight_.front().done) {
+        uint64_t tag;
+        ssize_t res;
+        ring_.Complete(tag, res);
+        Request& r = inflight_[tag - tag_];
+        r.res = res;
+        r.done = true;
+    }
+    Request r = inflight_.front();
+    inflight_.pop_front();
+    tag_++;
+
+    // a short write (e.g. interrupted) is completed synchronously
+    errno = r.res < 0 ? -r.res : 0;
+    if (r.res < 0 || (size_t(r.res) < r.size &&
+                      !file_pwrite(fd_buffered_, r.data + r.res,
+                                   r.size - r.res, r.pos + r.res))) {
+        if (!output_failed_) {
+            LOG_ERR(("Failed to write output file: %s (%s)")
+                    % output_filename_ % strerror(errno));
+        }
+        output_failed_ = true;
+    }
+    block_cnt_++;
+    TRACEX(("block %014p => file (%s), bsize = %d")
+           % BlockTraits<Block>::RawPtr(r.block) % block_cnt_
+           % r.block->size());
+    return r.block;
+}
+
+/// ----------------------------------------------------------------------------
+/// File operations
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::FileOpen()
+{
+    LOG_INF(("opening file w %s (io_uring)") % output_filename_);
+    TRACEX(("output file %s") % output_filename_);
+    inflight_.clear();
+    tag_ = 0;
+    int flags = O_WRONLY | O_CREAT | (output_inplace_ ? 0 : O_TRUNC);
+    fd_ = direct_open(output_filename_, flags);
+    if (fd_ >= 0) {
+        fd_buffered_ = ::open(output_filename_.c_str(), O_WRONLY);
+        ring_.Init(URING_DEPTH);
+    }
+    output_failed_ = fd_ < 0 || fd_buffered_ < 0;
+    if (output_failed_) {
+        LOG_ERR(("Failed to open output file: %s") % output_filename_);
+    }
+    output_pos_ = output_offset_;
+}
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::FileWriteRange(int fd, const char* data,
+                                                   size_t size)
+{
+    // the rest of a failed output is dropped
+    if (!size || output_failed_) {
+        return;
+    }
+    if (!file_pwrite(fd, data, size, output_pos_)) {
+        LOG_ERR(("Failed to write output file: %s (%s)")
+                % output_filename_ % strerror(errno));
+        output_failed_ = true;
+        return;
+    }
+    output_pos_ += size;
+}
+
+template <typename Block>
+void BlockUringWritePolicy<Block>::FileClose()
+{
+    ring_.Exit();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (fd_buffered_ >= 0) {
+        ::close(fd_buffered_);
+        fd_buffered_ = -1;
+    }
+}
+
+} // namespace block
+} // namespace external_sort
+
+#endif
@@ -20,6 +20,21 @@ struct CustomRecordComparator
     }
 };
 
+struct CustomRecordKey
+{
+    using KeyType = uint32_t;
+    KeyType operator()(const CustomRecord& x) const {
+        return x.id;
+    }
+};
+
+struct CustomRecordKeepFirst
+{
+    void operator()(CustomRecord&, const CustomRecord&) const {
+        // keep the record seen first, drop the others with the same id
+    }
+};
+
 struct CustomRecord2Str
 {
     std::string operator()(const CustomRecord& x)
@@ -59,6 +74,14 @@ struct ValueTraits<CustomRecord>
     using Generator = CustomRecordGenerator;
     using Value2Str = CustomRecord2Str;
 
+    // records are wide, so sort blocks indirectly by the id
+    // (or, alternatively, radix sort the records themselves)
+    using IndirectKey = CustomRecordKey;
+    // using RadixKey = CustomRecordKey;
+
+    // keep one record per id (records with equal ids are collapsed)
+    // using Combiner = CustomRecordKeepFirst;
+
     // .. or default generator with all random bytes:
     // using Generator = DefaultValueGenerator<CustomRecord>;
 };
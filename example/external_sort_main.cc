@@ -2,6 +2,7 @@
 #include <sstream>
 #include <memory>
 #include <list>
+#include <unordered_set>
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
 
@@ -32,6 +33,9 @@ const uint8_t ACT_CHK = 1 << 3; // check
 const char* DEF_MRG_RES_SFX = ".sorted";
 const char* DEF_GEN_OFILE = "generated";
 
+// set if an action failed (e.g. an i/o error): the exit code is 1 then
+bool act_failed = false;
+
 /// ----------------------------------------------------------------------------
 /// auxiliary functions
 
@@ -84,50 +88,159 @@ std::string replace_dirname(const std::string& pathname,
 /// ----------------------------------------------------------------------------
 /// action: split/sort
 
-std::list<std::string> act_split(const po::variables_map& vm)
+// are the runs merged right away?
+bool split_merged(const po::variables_map& vm)
 {
-    LOG_IMP(("\n*** Phase 1: Splitting and Sorting"));
-    LOG_IMP(("Input file: %s") % vm["spl.ifile"].as<std::string>());
-    log_params(vm, "spl");
-    TIMER("Done in %t sec CPU, %w sec real\n");
+    const auto& action = vm["act"].as<std::string>();
+    return (action == "all" || action == "srt");
+}
 
-    external_sort::SplitParams params;
+// runs merged right away are encoded as the other temporary files,
+// unless merged in key ranges (read at byte offsets, they stay raw)
+bool split_encode(const po::variables_map& vm)
+{
+    return (vm["spl.encode"].defaulted()
+            ? split_merged(vm) && vm["mrg.encode"].as<bool>()
+            : vm["spl.encode"].as<bool>()) &&
+           vm["mrg.parts"].as<size_t>() <= 1;
+}
+
+void set_split_params(const po::variables_map& vm,
+                      external_sort::SplitParams& params)
+{
     params.mem.size   = vm["msize"].as<size_t>();
     params.mem.unit   = vm["memunit"].as<external_sort::MemUnit>();
     params.mem.blocks = vm["spl.blocks"].as<size_t>();
+    params.mem.drop   = vm["drop"].as<size_t>();
     params.spl.ifile  = vm["spl.ifile"].as<std::string>();
     params.spl.ofile  = vm["spl.ofile"].as<std::string>();
+    params.spl.readers = vm["spl.readers"].as<size_t>();
+    params.spl.workers = vm["spl.workers"].as<size_t>();
+    params.spl.threads = vm["spl.threads"].as<size_t>();
+    params.spl.rsel   = vm["spl.rsel"].as<bool>();
+    params.spl.natural = vm["spl.natural"].as<bool>();
+    params.spl.encode = split_encode(vm);
+    params.spl.raw_first = split_merged(vm);
+}
+
+std::list<std::string> act_split(const po::variables_map& vm,
+                                 std::unordered_set<std::string>& encoded)
+{
+    LOG_IMP(("\n*** Phase 1: Splitting and Sorting"));
+    LOG_IMP(("Input file: %s") % vm["spl.ifile"].as<std::string>());
+    log_params(vm, "spl");
+    TIMER("Done in %t sec CPU, %w sec real\n");
+
+    external_sort::SplitParams params;
+    set_split_params(vm, params);
 
     external_sort::split<ValueType>(params);
     if (params.err) {
         LOG_ERR(("Error: %s") % params.err.msg());
+        act_failed = true;
     }
+    encoded = params.out.oencoded;
     return params.out.ofiles;
 }
 
 /// ----------------------------------------------------------------------------
 /// action: merge
 
-void act_merge(const po::variables_map& vm, std::list<std::string>& files)
+void set_merge_params(const po::variables_map& vm,
+                      external_sort::MergeParams& params)
 {
-    LOG_IMP(("\n*** Phase 2: Merging"));
-    log_params(vm, "mrg");
-    TIMER("Done in %t sec CPU, %w sec real\n");
-
-    external_sort::MergeParams params;
     params.mem.size      = vm["msize"].as<size_t>();
     params.mem.unit      = vm["memunit"].as<external_sort::MemUnit>();
+    params.mem.drop      = vm["drop"].as<size_t>();
     params.mrg.merges    = vm["mrg.merges"].as<size_t>();
     params.mrg.kmerge    = vm["mrg.kmerge"].as<size_t>();
     params.mrg.stmblocks = vm["mrg.stmblocks"].as<size_t>();
-    params.mrg.ifiles    = files;
+    params.mrg.parts     = vm["mrg.parts"].as<size_t>();
+    params.mrg.plan      = vm["mrg.plan"].as<bool>();
+    params.mrg.ioblock   = vm["mrg.ioblock"].as<size_t>() << 10;
+    params.mrg.overlap   = vm["mrg.overlap"].as<bool>();
     params.mrg.tfile     = vm["mrg.tfile"].as<std::string>();
     params.mrg.ofile     = vm["mrg.ofile"].as<std::string>();
     params.mrg.rm_input  = !vm["no_rm"].as<bool>();
+    params.mrg.encode    = vm["mrg.encode"].as<bool>();
+}
+
+void act_merge(const po::variables_map& vm, std::list<std::string>& files,
+               const std::unordered_set<std::string>& encoded)
+{
+    LOG_IMP(("\n*** Phase 2: Merging"));
+    log_params(vm, "mrg");
+    TIMER("Done in %t sec CPU, %w sec real\n");
+
+    external_sort::MergeParams params;
+    set_merge_params(vm, params);
+    params.mrg.ifiles    = files;
+    // the runs of the split phase are encoded as it wrote them
+    if (vm["mrg.iencoded"].defaulted()) {
+        params.mrg.iencoded = encoded;
+    } else if (vm["mrg.iencoded"].as<bool>()) {
+        params.mrg.iencoded.insert(files.begin(), files.end());
+    }
 
     external_sort::merge<ValueType>(params);
     if (params.err) {
         LOG_ERR(("Error: %s") % params.err.msg());
+        act_failed = true;
+    }
+}
+
+/// ----------------------------------------------------------------------------
+/// action: split and merge overlapped
+
+void act_sort(const po::variables_map& vm)
+{
+    LOG_IMP(("\n*** Phase 1+2: Splitting and Merging (overlapped)"));
+    LOG_IMP(("Input file: %s") % vm["spl.ifile"].as<std::string>());
+    log_params(vm, "spl");
+    log_params(vm, "mrg");
+    TIMER("Done in %t sec CPU, %w sec real\n");
+
+    external_sort::SplitParams sp;
+    external_sort::MergeParams mp;
+    set_split_params(vm, sp);
+    set_merge_params(vm, mp);
+
+    external_sort::sort<ValueType>(sp, mp);
+    if (sp.err) {
+        LOG_ERR(("Error: %s") % sp.err.msg());
+        act_failed = true;
+    }
+    if (mp.err) {
+        LOG_ERR(("Error: %s") % mp.err.msg());
+        act_failed = true;
+    }
+}
+
+/// ----------------------------------------------------------------------------
+/// action: top-k (only the smallest values are sorted and output)
+
+void act_topk(const po::variables_map& vm)
+{
+    LOG_IMP(("\n*** Phase 1+2: Top %d values")
+            % vm["srt.top"].as<size_t>());
+    LOG_IMP(("Input file: %s") % vm["spl.ifile"].as<std::string>());
+    log_params(vm, "spl");
+    log_params(vm, "mrg");
+    TIMER("Done in %t sec CPU, %w sec real\n");
+
+    external_sort::SplitParams sp;
+    external_sort::MergeParams mp;
+    set_split_params(vm, sp);
+    set_merge_params(vm, mp);
+
+    external_sort::topk<ValueType>(sp, mp, vm["srt.top"].as<size_t>());
+    if (sp.err) {
+        LOG_ERR(("Error: %s") % sp.err.msg());
+        act_failed = true;
+    }
+    if (mp.err) {
+        LOG_ERR(("Error: %s") % mp.err.msg());
+        act_failed = true;
     }
 }
 
@@ -145,12 +258,14 @@ void act_generate(const po::variables_map& vm)
     params.mem.size   = vm["msize"].as<size_t>();
     params.mem.unit   = vm["memunit"].as<external_sort::MemUnit>();
     params.mem.blocks = vm["gen.blocks"].as<size_t>();
+    params.mem.drop   = vm["drop"].as<size_t>();
     params.gen.ofile  = vm["gen.ofile"].as<std::string>();
     params.gen.fsize  = vm["gen.fsize"].as<size_t>();
 
     external_sort::generate<ValueType>(params);
     if (params.err) {
         LOG_ERR(("Error: %s") % params.err.msg());
+        act_failed = true;
     }
 }
 
@@ -168,11 +283,13 @@ void act_check(const po::variables_map& vm)
     params.mem.size   = vm["msize"].as<size_t>();
     params.mem.unit   = vm["memunit"].as<external_sort::MemUnit>();
     params.mem.blocks = vm["chk.blocks"].as<size_t>();
+    params.mem.drop   = vm["drop"].as<size_t>();
     params.chk.ifile  = vm["chk.ifile"].as<std::string>();
 
     external_sort::check<ValueType>(params);
     if (params.err) {
         LOG_ERR(("The input file is NOT sorted!"));
+        act_failed = true;
     }
     LOG_IMP(("%s") % params.err.msg());
 }
@@ -210,6 +327,12 @@ int main(int argc, char *argv[])
          po::value<std::string>()->default_value("M"),
          "Memory unit: <B | K | M>")
 
+        ("drop",
+         po::value<size_t>()->default_value(0),
+         "Files to drop from the page cache as they are\n"
+         "read/written (sum of): 1 - input, 2 - temporary,\n"
+         "4 - output")
+
         ("log",
          po::value<int>()->default_value(4),
          "Log level: [0-6]")
@@ -245,6 +368,11 @@ int main(int argc, char *argv[])
          po::value<std::string>()->default_value(""),
          "Same as --spl.ifile")
 
+        ("srt.top",
+         po::value<size_t>()->default_value(0),
+         "Output only the N smallest values (top-k)\n"
+         "(relevant if act=all or act=srt, 0 = all)")
+
         ("spl.ifile",
          po::value<std::string>()->default_value("<gen.ofile>"),
          "Input file")
@@ -255,7 +383,39 @@ int main(int argc, char *argv[])
 
         ("spl.blocks",
          po::value<size_t>()->default_value(2),
-         "Number of blocks in memory");
+         "Number of blocks in memory")
+
+        ("spl.readers",
+         po::value<size_t>()->default_value(1),
+         "Number of parallel readers, each splitting its own part "
+         "of the input file")
+
+        ("spl.workers",
+         po::value<size_t>()->default_value(0),
+         "Number of worker threads sorting and writing blocks\n"
+         "(0 = number of hardware threads)")
+
+        ("spl.threads",
+         po::value<size_t>()->default_value(1),
+         "Number of tasks sorting a single block\n"
+         "(run by the spl.workers threads)")
+
+        ("spl.rsel",
+         po::value<bool>()->
+             zero_tokens()->default_value(false)->implicit_value(true),
+         "Form runs by replacement selection\n"
+         "(random input: runs of ~1.75x the memory, i.e. ~3.5x the blocks\n"
+         "of spl.blocks = 2; one run if the input is sorted)")
+
+        ("spl.natural",
+         po::value<bool>()->default_value(true),
+         "Detect already sorted blocks and write them without sorting\n"
+         "(consecutive sorted blocks make one run)")
+
+        ("spl.encode",
+         po::value<bool>()->default_value(false, "<mrg.encode if merged>"),
+         "Encode the runs (delta + bit-packing, integer values only;\n"
+         "by default only if act merges them)");
 
     po::options_description mrg_desc("Options for act=mrg (phase 2: merge)");
     mrg_desc.add_options()
@@ -281,7 +441,39 @@ int main(int argc, char *argv[])
 
         ("mrg.stmblocks",
          po::value<size_t>()->default_value(2),
-         "Number of memory blocks per stream");
+         "Number of memory blocks per stream\n"
+         "(merge inputs: read-ahead blocks shared\n"
+         "by the streams)")
+
+        ("mrg.parts",
+         po::value<size_t>()->default_value(1),
+         "Number of key ranges merged in parallel\n"
+         "by the final merge")
+
+        ("mrg.plan",
+         po::value<bool>()->
+             zero_tokens()->default_value(false)->implicit_value(true),
+         "Choose mrg.merges, mrg.kmerge and mrg.stmblocks automatically\n"
+         "(fewest passes over the data)")
+
+        ("mrg.ioblock",
+         po::value<size_t>()->default_value(64),
+         "Min size of a stream block in KB (relevant if mrg.plan)")
+
+        ("mrg.encode",
+         po::value<bool>()->default_value(true),
+         "Encode the intermediate merge outputs\n"
+         "(integer values only, relevant if mrg.parts = 1)")
+
+        ("mrg.iencoded",
+         po::value<bool>()->default_value(false, "<as split wrote them>"),
+         "Input files are encoded runs (written with spl.encode)")
+
+        ("mrg.overlap",
+         po::value<bool>()->
+             zero_tokens()->default_value(false)->implicit_value(true),
+         "Merge runs in the background while splitting\n"
+         "(relevant if act=all or act=srt)");
 
     po::options_description chk_desc("Options for act=chk (check)");
     chk_desc.add_options()
@@ -374,6 +566,7 @@ int main(int argc, char *argv[])
     }
 
     std::list<std::string> files;
+    std::unordered_set<std::string> encoded;   // the runs written encoded
 
     // adjust filename variables according to the provided options
     if (!vm["srt.ifile"].defaulted()) {
@@ -428,15 +621,23 @@ int main(int argc, char *argv[])
     if (act & ACT_GEN) {
         act_generate(vm);
     }
-    if (act & ACT_SPL) {
-        files = act_split(vm);
-    }
-    if (act & ACT_MRG) {
-        act_merge(vm, files);
+    if ((act & ACT_SPL) && (act & ACT_MRG) && vm["srt.top"].as<size_t>()) {
+        act_topk(vm);
+    } else if ((act & ACT_SPL) && (act & ACT_MRG) &&
+               vm["mrg.overlap"].as<bool>()) {
+        act_sort(vm);
+    } else {
+        if (act & ACT_SPL) {
+            files = act_split(vm, encoded);
+        }
+        // (the runs of a failed split are not merged)
+        if ((act & ACT_MRG) && !act_failed) {
+            act_merge(vm, files, encoded);
+        }
     }
     if (act & ACT_CHK) {
         act_check(vm);
     }
 
-    return 0;
+    return act_failed ? 1 : 0;
 }
@@ -5,11 +5,22 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <utility>
+#include <functional>
 #include <memory>
+#include <thread>
+#include <vector>
 #include <list>
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "external_sort_nolog.hpp"
 #include "external_sort_types.hpp"
+#include "external_sort_split.hpp"
 #include "external_sort_merge.hpp"
 #include "async_funcs.hpp"
 
@@ -33,6 +44,87 @@ SizeType memsize_in_bytes(const SizeType& memsize, const MemUnit& u)
     return memsize;
 }
 
+inline size_t file_size(const std::string& filename)
+{
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? size_t(st.st_size) : 0;
+}
+
+// drops the files which no longer exist (e.g. merged and removed)
+inline void remove_gone_files(std::list<std::string>& files)
+{
+    files.remove_if([] (const std::string& file) {
+        return access(file.c_str(), F_OK) != 0;
+    });
+}
+
+// should the files of the role be dropped from the page cache?
+inline bool drop_cache(const MemParams& mem, CacheRole role)
+{
+    return mem.drop & role;
+}
+
+// merge inputs removed when merged are temporary files (splits)
+inline CacheRole merge_input_role(const MergeParams& params)
+{
+    return params.mrg.rm_input ? CACHE_TEMP : CACHE_INPUT;
+}
+
+// blocks of the pool shared by the input streams of a merge: one for each
+// stream and stmblocks read-ahead blocks, which forecasting hands out to
+// the streams running out first (rather than stmblocks for each stream,
+// i.e. fewer and larger blocks in the same memory)
+inline size_t merge_pool_blocks(const MergeParams& params, size_t nstreams)
+{
+    return nstreams + params.mrg.stmblocks;
+}
+
+// adds the file of an output stream (run) to the split result and tells
+// whoever waits
+template <typename StreamPtr>
+void add_ofile(SplitParams& params, const StreamPtr& stream)
+{
+    const auto& filename = stream->output_filename();
+    bool encoded = stream->output_encoded();
+    params.out.ofiles.push_back(filename);
+    if (encoded) {
+        params.out.oencoded.insert(filename);
+    }
+    if (params.out.ready) {
+        params.out.ready(filename, encoded);
+    }
+}
+
+// reports the input stream if its file could not be (fully) read
+template <typename StreamPtr>
+bool report_input_failure(ErrParams& err, const StreamPtr& stream)
+{
+    if (!stream->input_failed()) {
+        return false;
+    }
+    if (err.stream.tellp() > 0) {
+        err.stream << "; ";
+    }
+    err.none = false;
+    err.stream << "Cannot read " << stream->input_filename();
+    return true;
+}
+
+// reports the output stream if its file could not be (fully) written
+template <typename StreamPtr>
+bool report_output_failure(ErrParams& err, const StreamPtr& stream)
+{
+    if (!stream->output_failed()) {
+        return false;
+    }
+    if (err.stream.tellp() > 0) {
+        err.stream << "; ";
+    }
+    err.none = false;
+    err.stream << "Cannot write " << stream->output_filename();
+    return true;
+}
+
 template <typename IndexType>
 std::string make_tmp_filename(const std::string& prefix,
                               const std::string& suffix,
@@ -47,107 +139,1065 @@ std::string make_tmp_filename(const std::string& prefix,
 template <typename ValueType>
 typename Types<ValueType>::OStreamPtr
 sort_and_write(typename Types<ValueType>::BlockPtr block,
-               typename Types<ValueType>::OStreamPtr ostream)
+               typename Types<ValueType>::OStreamPtr ostream,
+               size_t nthreads, aux::TaskRunner* runner, size_t limit)
 {
+    if (limit && limit < block->size() && !CombinerTraits<ValueType>::enabled) {
+        // only the smallest values are kept, so sort just them
+        std::nth_element(block->begin(), block->begin() + limit, block->end(),
+                         typename Types<ValueType>::Comparator());
+        block->resize(limit);
+    }
+
     // sort the block
-    std::sort(block->begin(), block->end(),
-              typename Types<ValueType>::Comparator());
+    sort_block<ValueType>(block->begin(), block->end(), nthreads, runner);
     TRACE(("block %014p sorted") %
           Types<ValueType>::BlockTraits::RawPtr(block));
+    combine_block<ValueType>(*block);
+    if (limit && limit < block->size()) {
+        block->resize(limit);
+    }
 
     // write the block to the output stream
     ostream->WriteBlock(block);
     return ostream;
 }
 
+template <typename StreamPtr>
+StreamPtr pass_through(StreamPtr stream)
+{
+    // nothing to do with the stream, just hand it over to be collected
+    return stream;
+}
+
 /// ----------------------------------------------------------------------------
-/// main external sorting functions
+/// split modes
 
-//! External Split
+//! Splits the input into sorted blocks (one run per block).
+//! Blocks that are already sorted (or reverse sorted) are not sorted again,
+//! consecutive sorted blocks continuing each other make one natural run
 template <typename ValueType>
-void split(SplitParams& params)
+void split_blocks(SplitParams& params)
 {
     TRACE_FUNC();
     size_t file_cnt = 0;
+    auto comp = typename Types<ValueType>::Comparator();
 
-    aux::AsyncFuncs<typename Types<ValueType>::OStreamPtr> splits;
+    aux::AsyncFuncs<typename Types<ValueType>::OStreamPtr> splits(
+        params.spl.workers);
 
     // create memory pool to be shared between input and output streams
+    // (less the memory the blocks take while being sorted)
     auto mem_pool = std::make_shared<typename Types<ValueType>::BlockPool>(
-        memsize_in_bytes(params.mem.size, params.mem.unit), params.mem.blocks);
+        sort_blocks_memsize<ValueType>(
+            memsize_in_bytes(params.mem.size, params.mem.unit),
+            params.mem.blocks, params.spl.threads),
+        params.mem.blocks);
 
     // create the input stream
     auto istream = std::make_shared<typename Types<ValueType>::IStream>();
     istream->set_mem_pool(mem_pool);
     istream->set_input_filename(params.spl.ifile);
     istream->set_input_rm_file(params.spl.rm_input);
+    istream->set_input_range(params.spl.ioffset, params.spl.isize);
+    istream->set_input_drop_cache(drop_cache(params.mem, CACHE_INPUT));
     istream->Open();
 
-    if (params.spl.ofile.empty()) {
-        // if no output prefix given, use input filename as a prefix
-        params.spl.ofile = params.spl.ifile;
-    }
+    // current natural run, its last value and its number of values
+    typename Types<ValueType>::OStreamPtr nrun;
+    ValueType nrun_last = ValueType();
+    size_t nrun_size = 0;
+    size_t limit = params.spl.limit;
 
     while (!istream->Empty()) {
         // read a block from the input stream
         auto block = istream->FrontBlock();
         istream->PopBlock();
 
-        // create an output stream
-        auto ostream = std::make_shared<typename Types<ValueType>::OStream>();
-        ostream->set_mem_pool(mem_pool);
-        ostream->set_output_filename(
-            make_tmp_filename(params.spl.ofile, DEF_SPL_TMP_SFX, ++file_cnt));
-        ostream->Open();
+        bool sorted = params.spl.natural &&
+                      make_ascending(block->begin(), block->end(), comp);
+        if (sorted) {
+            combine_block<ValueType>(*block);
+        }
+        // (with a combiner, equal values must not span two blocks of a run)
+        bool cont = CombinerTraits<ValueType>::enabled
+                        ? comp(nrun_last, block->front())
+                        : !comp(block->front(), nrun_last);
+        if (nrun && !(sorted && cont)) {
+            // the natural run is over, hand it over to be collected
+            splits.Async(&pass_through<typename Types<ValueType>::OStreamPtr>,
+                         std::move(nrun));
+            nrun = nullptr;
+        }
+
+        if (sorted) {
+            // the block is sorted already, start or continue a natural run
+            if (!nrun) {
+                nrun = std::make_shared<typename Types<ValueType>::OStream>();
+                nrun->set_mem_pool(mem_pool);
+                nrun->set_output_filename(make_tmp_filename(
+                    params.spl.ofile, DEF_SPL_TMP_SFX, ++file_cnt));
+                nrun->set_output_drop_cache(drop_cache(params.mem, CACHE_TEMP));
+                nrun->set_output_encoded(params.spl.encode &&
+                    !(params.spl.raw_first && file_cnt == 1));
+                nrun->Open();
+                nrun_size = 0;
+            }
+            TRACE(("block %014p is sorted already") %
+                  Types<ValueType>::BlockTraits::RawPtr(block));
+            if (limit && nrun_size + block->size() > limit) {
+                // the run has its smallest values already, drop the rest
+                block->resize(limit - nrun_size);
+            }
+            if (block->empty()) {
+                mem_pool->Free(block);
+            } else {
+                nrun_last = block->back();
+                nrun_size += block->size();
+                nrun->PushBlock(block);
+            }
+
+            if (istream->Empty()) {
+                splits.Async(
+                    &pass_through<typename Types<ValueType>::OStreamPtr>,
+                    std::move(nrun));
+                nrun = nullptr;
+            }
+        } else {
+            // create an output stream
+            auto ostream =
+                std::make_shared<typename Types<ValueType>::OStream>();
+            ostream->set_mem_pool(mem_pool);
+            ostream->set_output_filename(make_tmp_filename(
+                params.spl.ofile, DEF_SPL_TMP_SFX, ++file_cnt));
+            ostream->set_output_drop_cache(drop_cache(params.mem, CACHE_TEMP));
+            ostream->set_output_encoded(params.spl.encode &&
+                !(params.spl.raw_first && file_cnt == 1));
+            ostream->Open();
 
-        // asynchronously sort the block and write it to the output stream
-        splits.Async(&sort_and_write<ValueType>,
-                     std::move(block), std::move(ostream));
+            // asynchronously sort the block and write it to the output stream
+            // (the sort itself runs in tasks on the same workers)
+            splits.Async(&sort_and_write<ValueType>, std::move(block),
+                         std::move(ostream), params.spl.threads,
+                         static_cast<aux::TaskRunner*>(&splits), limit);
+        }
 
-        // collect the results
-        while ((splits.Ready() > 0) || (splits.Running() && istream->Empty())) {
+        // collect the results; wait for some if there are more blocks
+        // queued than the workers can take (backpressure)
+        while ((splits.Ready() > 0) ||
+               (splits.Running() && istream->Empty()) ||
+               (splits.Running() > splits.Workers())) {
             // wait for any split and get its output filename
             auto ostream_ready = splits.GetAny();
             if (ostream_ready) {
                 ostream_ready->Close();
-                params.out.ofiles.push_back(ostream_ready->output_filename());
+                report_output_failure(params.err, ostream_ready);
+                add_ofile(params, ostream_ready);
             }
         }
     }
     istream->Close();
+    report_input_failure(params.err, istream);
+}
+
+//! Splits the input into runs formed by replacement selection: the values
+//! in memory are kept in a heap, the smallest one is output and replaced by
+//! the next input value, which joins the current run if it's not smaller
+//! than the value just output. On random input runs are about twice as long
+//! as the heap (7/8 of the memory), sorted input gives a single run
+template <typename ValueType>
+void split_rsel(SplitParams& params)
+{
+    TRACE_FUNC();
+    size_t file_cnt = 0;
+    using Heap = SelectionHeap<ValueType, typename Types<ValueType>::Comparator,
+                               typename Types<ValueType>::Block>;
+
+    // most of the memory is for the heap, 1/8 is for the i/o streams;
+    // the heap values are stored in a block of the pool (and nothing else)
+    size_t mem = memsize_in_bytes(params.mem.size, params.mem.unit);
+    size_t mem_stream = mem / 16;
+    size_t mem_heap = mem - 2 * mem_stream;
+    auto heap_pool = std::make_shared<typename Types<ValueType>::BlockPool>(
+        mem_heap, 1);
+    auto ostream_pool = std::make_shared<typename Types<ValueType>::BlockPool>(
+        mem_stream, params.mem.blocks);
+
+    auto istream = std::make_shared<typename Types<ValueType>::IStream>();
+    istream->set_mem_pool(mem_stream, params.mem.blocks);
+    istream->set_input_filename(params.spl.ifile);
+    istream->set_input_rm_file(params.spl.rm_input);
+    istream->set_input_range(params.spl.ioffset, params.spl.isize);
+    istream->set_input_drop_cache(drop_cache(params.mem, CACHE_INPUT));
+    istream->Open();
+
+    // fill in the memory
+    auto values = heap_pool->Allocate();
+    while (values->size() < values->capacity() && !istream->Empty()) {
+        values->push_back(istream->Front());
+        istream->Pop();
+    }
+
+    if (!values->empty()) {
+        using OStream = typename Types<ValueType>::OStream;
+        using Comparator = typename Types<ValueType>::Comparator;
+        using RunOutput = CombineOutput<LimitOutput<OStream>, Comparator,
+            typename CombinerTraits<ValueType>::Combiner>;
+        Heap heap(*values, Comparator());
+        typename Types<ValueType>::OStreamPtr ostream;
+        LimitOutput<OStream> limit_output(nullptr, params.spl.limit);
+        RunOutput output(nullptr);
+        size_t run = Heap::RUN_NONE;
+
+        while (heap.WinnerRun() != Heap::RUN_NONE) {
+            if (heap.WinnerRun() != run) {
+                // the current run is over, start the next one
+                if (ostream) {
+                    output.Flush();
+                    ostream->Close();
+                    report_output_failure(params.err, ostream);
+                    add_ofile(params, ostream);
+                }
+                run = heap.WinnerRun();
+                ostream = std::make_shared<
+                    typename Types<ValueType>::OStream>();
+                ostream->set_mem_pool(ostream_pool);
+                ostream->set_output_filename(make_tmp_filename(
+                    params.spl.ofile, DEF_SPL_TMP_SFX, ++file_cnt));
+                ostream->set_output_drop_cache(drop_cache(params.mem, CACHE_TEMP));
+                ostream->set_output_encoded(params.spl.encode &&
+                    !(params.spl.raw_first && file_cnt == 1));
+                ostream->Open();
+                limit_output = LimitOutput<OStream>(ostream.get(),
+                                                    params.spl.limit);
+                output = RunOutput(&limit_output);
+            }
+            output.Push(heap.Winner());
+
+            if (!istream->Empty()) {
+                heap.Replace(istream->Front());
+                istream->Pop();
+            } else {
+                heap.Remove();
+            }
+        }
+        output.Flush();
+        ostream->Close();
+        report_output_failure(params.err, ostream);
+        add_ofile(params, ostream);
+        LOG_INF(("replacement selection: %d runs") % file_cnt);
+    }
+    heap_pool->Free(values);
+    istream->Close();
+    report_input_failure(params.err, istream);
+}
+
+template <typename ValueType>
+void split(SplitParams& params);
+
+//! Splits the input by several readers in parallel: each reader gets its
+//! own (record aligned) part of the input file, a share of the memory and
+//! of the workers, and runs a split of its own
+template <typename ValueType>
+void split_parallel(SplitParams& params)
+{
+    TRACE_FUNC();
+    size_t readers = params.spl.readers;
+    size_t workers = params.spl.workers ? params.spl.workers
+                                        : std::thread::hardware_concurrency();
+
+    int fd = ::open(params.spl.ifile.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        params.err.none = false;
+        params.err.stream << "Cannot open " << params.spl.ifile << " ("
+                          << strerror(errno) << ")";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return;
+    }
+    ::close(fd);
+    // the input range [ioffset, ioffset + isize) is cut into the parts
+    size_t fsize = st.st_size;
+    size_t offset = std::min(params.spl.ioffset, fsize);
+    size_t size = fsize - offset;
+    if (params.spl.isize) {
+        size = std::min(size, params.spl.isize);
+    }
+    size_t elems = size / sizeof(ValueType);
+
+    std::vector<std::unique_ptr<SplitParams>> parts;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < readers; i++) {
+        size_t begin = elems * i / readers;
+        size_t end = elems * (i + 1) / readers;
+        if (begin == end) {
+            continue;
+        }
+        std::unique_ptr<SplitParams> part(new SplitParams);
+        part->mem.size = memsize_in_bytes(params.mem.size, params.mem.unit) /
+                         readers;
+        part->mem.unit = B;
+        part->mem.blocks = params.mem.blocks;
+        part->mem.drop = params.mem.drop;
+        part->spl = params.spl;
+        part->spl.ofile = make_tmp_filename(params.spl.ofile, "part", i + 1);
+        part->spl.rm_input = false;
+        part->spl.ioffset = offset + begin * sizeof(ValueType);
+        part->spl.isize = (end - begin) * sizeof(ValueType);
+        part->spl.readers = 1;
+        part->spl.workers = std::max<size_t>(1, workers / readers);
+        part->out.ready = params.out.ready;
+        threads.emplace_back(&split<ValueType>, std::ref(*part));
+        parts.push_back(std::move(part));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // collect the runs of all parts
+    for (auto& part : parts) {
+        params.out.ofiles.splice(params.out.ofiles.end(), part->out.ofiles);
+        params.out.oencoded.insert(part->out.oencoded.begin(),
+                                   part->out.oencoded.end());
+        if (part->err) {
+            params.err.none = false;
+            params.err.stream << part->err.msg();
+        }
+    }
+    if (params.spl.rm_input && params.err.none) {
+        if (remove(params.spl.ifile.c_str()) != 0) {
+            LOG_ERR(("Failed to remove file: %s") % params.spl.ifile);
+        }
+    }
+}
+
+/// ----------------------------------------------------------------------------
+/// merge modes
+
+// number of samples taken from each run per part to pick the splitters
+const size_t PMERGE_SAMPLES = 64;
+
+// A file of values read by single values (the probes of a binary search):
+// through pread, with O_DIRECT in the direct and io_uring builds, so the
+// probed pages don't fill the page cache either. The aligned page of
+// the last probe is kept, the next probes often hit it.
+template <typename ValueType>
+class ProbeFile
+{
+  public:
+    explicit ProbeFile(const std::string& filename);
+    ~ProbeFile();
+    ProbeFile(const ProbeFile&) = delete;
+    ProbeFile& operator=(const ProbeFile&) = delete;
+
+    bool is_open() const { return fd_ >= 0; }
+    size_t size() const { return size_; }      // number of values
+
+    // reads the value with the given index
+    ValueType read_value(size_t index);
+
+  private:
+    std::string filename_;
+    int fd_ = -1;
+    size_t size_ = 0;
+    block::DirectBlock<char> page_;             // aligned pages read
+    size_t page_pos_ = 0;                       // file offset of page_
+    size_t page_len_ = 0;                       // bytes of page_ read
+};
+
+template <typename ValueType>
+ProbeFile<ValueType>::ProbeFile(const std::string& filename)
+    : filename_(filename)
+{
+    fd_ = (DIRECT_IO || URING_IO) ? block::direct_open(filename_, O_RDONLY)
+                                  : ::open(filename_.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        LOG_ERR(("Failed to open input file: %s (%s)")
+                % filename_ % strerror(errno));
+        return;
+    }
+    size_ = size_t(st.st_size) / sizeof(ValueType);
+}
+
+template <typename ValueType>
+ProbeFile<ValueType>::~ProbeFile()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+template <typename ValueType>
+ValueType ProbeFile<ValueType>::read_value(size_t index)
+{
+    ValueType value;
+    size_t pos = index * sizeof(ValueType);
+    if (pos < page_pos_ || pos + sizeof(ValueType) > page_pos_ + page_len_) {
+        // read the aligned pages holding the value
+        page_pos_ = block::direct_align_down(pos);
+        page_.resize(block::direct_align_up(pos + sizeof(ValueType)) -
+                     page_pos_);
+        ssize_t n = block::file_pread(fd_, page_.data(), page_.size(),
+                                      page_pos_);
+        page_len_ = (n < 0) ? 0 : n;
+        if (pos + sizeof(ValueType) > page_pos_ + page_len_) {
+            LOG_ERR(("Failed to read input file: %s") % filename_);
+            memset(&value, 0, sizeof(ValueType));
+            return value;
+        }
+    }
+    memcpy(&value, page_.data() + (pos - page_pos_), sizeof(ValueType));
+    return value;
+}
+
+// returns the index of the first value in [lo, hi) of a sorted file
+// that is not less than the given one (std::lower_bound on a file)
+template <typename ValueType, typename Comparator>
+size_t file_lower_bound(ProbeFile<ValueType>& file, size_t lo, size_t hi,
+                        const ValueType& value, Comparator comp)
+{
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (comp(file.read_value(mid), value)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Cuts the sorted files into the given number of parts by key ranges.
+// The splitter keys are picked from a weighted sample of all files, so
+// that the parts get about the same number of values, and then every file
+// is cut at the lower bound of every splitter (binary search in the file).
+// Returns the cuts: (parts + 1) indexes of the values per file.
+template <typename ValueType>
+std::vector<std::vector<size_t>> partition_files(
+    const std::vector<std::string>& files, size_t parts)
+{
+    TRACE_FUNC();
+    using Comparator = typename Types<ValueType>::Comparator;
+    auto comp = Comparator();
+
+    std::vector<std::unique_ptr<ProbeFile<ValueType>>> pfiles;
+    std::vector<size_t> sizes(files.size());
+    std::vector<std::pair<ValueType, size_t>> samples;
+    size_t total = 0;
+
+    for (size_t i = 0; i < files.size(); i++) {
+        pfiles.emplace_back(new ProbeFile<ValueType>(files[i]));
+        sizes[i] = pfiles[i]->size();
+        total += sizes[i];
+
+        // every sample stands for (size / nsamples) values of its file
+        size_t nsamples = std::min(sizes[i], parts * PMERGE_SAMPLES);
+        for (size_t j = 0; j < nsamples; j++) {
+            samples.emplace_back(
+                pfiles[i]->read_value(j * sizes[i] / nsamples),
+                sizes[i] / nsamples);
+        }
+    }
+    std::sort(samples.begin(), samples.end(),
+              [&comp](const std::pair<ValueType, size_t>& x,
+                      const std::pair<ValueType, size_t>& y) {
+                  return comp(x.first, y.first);
+              });
+
+    std::vector<std::vector<size_t>> cuts(files.size(),
+                                          std::vector<size_t>(parts + 1));
+    for (size_t i = 0; i < files.size(); i++) {
+        cuts[i][parts] = sizes[i];
+    }
+
+    // the splitter p is the first sample reaching p/parts of all values
+    size_t weight = 0;
+    auto sample = samples.begin();
+    for (size_t p = 1; p < parts; p++) {
+        while (sample != samples.end() && weight < p * total / parts) {
+            weight += (sample++)->second;
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            cuts[i][p] = (sample == samples.end()) ? sizes[i] :
+                file_lower_bound(*pfiles[i], cuts[i][p - 1], sizes[i],
+                                 sample->first, comp);
+        }
+    }
+    return cuts;
+}
+
+// Merges the files into one by merging the given number of key ranges
+// (parts) in parallel. Every part is an independent k-merge of a range
+// of each file, writing into its own offset of the output file.
+template <typename ValueType>
+void merge_parallel(MergeParams& params, const std::vector<std::string>& files)
+{
+    TRACE_FUNC();
+    size_t parts = params.mrg.parts;
+    auto cuts = partition_files<ValueType>(files, parts);
+
+    // create (truncate) the output file; parts write into it in place
+    int fd = ::open(params.mrg.ofile.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, 0) != 0) {
+        params.err.none = false;
+        params.err.stream << "Cannot create " << params.mrg.ofile << " ("
+                          << strerror(errno) << ")";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return;
+    }
+    ::close(fd);
+
+    aux::AsyncFuncs<typename Types<ValueType>::OStreamPtr> merges(parts);
+
+    size_t mem_merge = memsize_in_bytes(params.mem.size, params.mem.unit) /
+                       parts;
+    size_t mem_ostream = mem_merge / 2;
+    size_t mem_istream = mem_merge - mem_ostream -
+        merge_kernel_memory<ValueType, typename Types<ValueType>::Comparator>(
+            files.size());
+
+    size_t offset = 0;
+    for (size_t p = 0; p < parts; p++) {
+        // the input streams of this part share the read-ahead blocks
+        size_t nstreams = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            nstreams += (cuts[i][p] != cuts[i][p + 1]);
+        }
+        if (nstreams == 0) {
+            continue;
+        }
+        auto pool = std::make_shared<typename Types<ValueType>::MStreamPool>(
+            mem_istream, merge_pool_blocks(params, nstreams));
+
+        // create a set of input streams with the ranges of this part
+        size_t size = 0;
+        std::unordered_set<typename Types<ValueType>::MStreamPtr> istreams;
+        for (size_t i = 0; i < files.size(); i++) {
+            size_t first = cuts[i][p], last = cuts[i][p + 1];
+            if (first == last) {
+                continue;
+            }
+            auto is = std::make_shared<typename Types<ValueType>::MStream>();
+            is->set_mem_pool(pool);
+            is->set_input_filename(files[i]);
+            is->set_input_range(first * sizeof(ValueType),
+                                (last - first) * sizeof(ValueType));
+            is->set_input_drop_cache(
+                drop_cache(params.mem, merge_input_role(params)));
+            istreams.insert(is);
+            size += last - first;
+        }
+        LOG_INF(("* part %d: %d values from %d files at offset %d")
+                % p % size % istreams.size() % offset);
+
+        // create an output stream writing at the offset of this part
+        auto ostream = std::make_shared<typename Types<ValueType>::OStream>();
+        ostream->set_mem_pool(mem_ostream, params.mrg.stmblocks);
+        ostream->set_output_filename(params.mrg.ofile);
+        ostream->set_output_offset(offset * sizeof(ValueType));
+        ostream->set_output_drop_cache(drop_cache(params.mem, CACHE_OUTPUT));
+        offset += size;
+
+        merges.Async(&merge_streams<typename Types<ValueType>::MStreamPtr,
+                                    typename Types<ValueType>::OStreamPtr>,
+                     std::move(istreams), std::move(ostream), 0);
+    }
+
+    while (!merges.Empty()) {
+        if (!merges.GetAny()) {
+            params.err.none = false;
+            params.err.stream << "Merge of a part failed";
+        }
+    }
+
+    // the input files are shared by the parts, remove them at the end
+    if (params.mrg.rm_input && params.err.none) {
+        for (const auto& file : files) {
+            if (remove(file.c_str()) != 0) {
+                LOG_ERR(("Failed to remove file: %s") % file);
+            }
+        }
+    }
+    if (params.err.none) {
+        LOG_IMP(("Output file: %s") % params.mrg.ofile);
+    }
+}
+
+// Merges the files and hands the result over to the sink (no output file)
+template <typename ValueType>
+void merge_to_sink(MergeParams& params,
+                   const std::multimap<size_t, std::string>& files,
+                   const std::unordered_set<std::string>& encoded,
+                   typename Types<ValueType>::Sink sink)
+{
+    TRACE_FUNC();
+    size_t mem_merge = memsize_in_bytes(params.mem.size, params.mem.unit);
+    size_t mem_ostream = mem_merge / 2;
+    size_t mem_istream = mem_merge - mem_ostream -
+        merge_kernel_memory<ValueType, typename Types<ValueType>::Comparator>(
+            files.size());
+
+    auto pool = std::make_shared<typename Types<ValueType>::MStreamPool>(
+        mem_istream, merge_pool_blocks(params, files.size()));
+
+    std::unordered_set<typename Types<ValueType>::MStreamPtr> istreams;
+    for (const auto& file : files) {
+        auto is = std::make_shared<typename Types<ValueType>::MStream>();
+        is->set_mem_pool(pool);
+        is->set_input_filename(file.second);
+        is->set_input_encoded(encoded.count(file.second) > 0);
+        is->set_input_rm_file(params.mrg.rm_input);
+        is->set_input_range(0, params.mrg.limit * sizeof(ValueType));
+        is->set_input_drop_cache(
+            drop_cache(params.mem, merge_input_role(params)));
+        istreams.insert(is);
+    }
+    LOG_INF(("* final merge of %d files to the sink") % files.size());
+
+    auto ostream = std::make_shared<typename Types<ValueType>::CStream>();
+    ostream->set_mem_pool(mem_ostream, params.mrg.stmblocks);
+    ostream->set_output_callback(sink);
+
+    if (!merge_streams(std::move(istreams), std::move(ostream),
+                       params.mrg.limit)) {
+        params.err.none = false;
+        params.err.stream << "Merge to the sink failed";
+    }
+}
+
+// Decodes the last (encoded) file to the output; like a rename, the file
+// is gone then
+template <typename ValueType>
+void decode_file(MergeParams& params, const std::string& file)
+{
+    TRACE_FUNC();
+    auto mem_pool = std::make_shared<typename Types<ValueType>::BlockPool>(
+        memsize_in_bytes(params.mem.size, params.mem.unit), params.mem.blocks);
+
+    auto istream = std::make_shared<typename Types<ValueType>::RStream>();
+    istream->set_mem_pool(mem_pool);
+    istream->set_input_filename(file);
+    istream->set_input_encoded(true);
+    istream->set_input_rm_file(true);
+    istream->set_input_range(0, params.mrg.limit * sizeof(ValueType));
+    istream->set_input_drop_cache(
+        drop_cache(params.mem, merge_input_role(params)));
+    istream->Open();
+
+    auto ostream = std::make_shared<typename Types<ValueType>::OStream>();
+    ostream->set_mem_pool(mem_pool);
+    ostream->set_output_filename(params.mrg.ofile);
+    ostream->set_output_drop_cache(drop_cache(params.mem, CACHE_OUTPUT));
+    ostream->Open();
+
+    while (!istream->Empty()) {
+        auto block = istream->FrontBlock();
+        istream->PopBlock();
+        ostream->PushBlock(block);
+    }
+    istream->Close();
+    ostream->Close();
+    if (report_input_failure(params.err, istream) |
+        report_output_failure(params.err, ostream)) {
+        // (a truncated or corrupted run fails its stream as well)
+        remove(params.mrg.ofile.c_str());
+        return;
+    }
+    LOG_IMP(("Output file: %s") % params.mrg.ofile);
+}
+
+/// ----------------------------------------------------------------------------
+/// sort modes
+
+template <typename ValueType>
+void merge(MergeParams& params,
+           typename Types<ValueType>::Sink sink = nullptr);
+
+//! Splits the input and, in the background, merges the runs kmerge at a
+//! time as soon as they are written. Both share the memory half and half.
+//! The final merge() gets the early merged files and the runs left over.
+template <typename ValueType>
+void sort_overlap(SplitParams& sp, MergeParams& mp,
+                  typename Types<ValueType>::Sink sink)
+{
+    TRACE_FUNC();
+    size_t mem = memsize_in_bytes(sp.mem.size, sp.mem.unit);
+    MemParams sp_mem = sp.mem;
+    sp.mem.size = mem / 2;
+    sp.mem.unit = B;
+
+    // the split passes the runs over as soon as they are written
+    // (with whether they are encoded)
+    aux::AsyncQueue<std::pair<std::string, bool>> runs;
+    sp.out.ready = [&runs] (const std::string& file, bool encoded) {
+        runs.Push(std::make_pair(file, encoded));
+    };
+    std::thread tsplit([&sp, &runs] () {
+        split<ValueType>(sp);
+        runs.Close();
+    });
+
+    std::list<std::string> files;
+    std::unordered_set<std::string> encoded;
+    size_t file_cnt = 0;
+    for (;;) {
+        std::list<std::string> ifiles;
+        for (const auto& run : runs.Pop(mp.mrg.kmerge)) {
+            ifiles.push_back(run.first);
+            if (run.second) {
+                encoded.insert(run.first);
+            }
+        }
+        if (ifiles.size() < mp.mrg.kmerge || !mp.err.none) {
+            // the split is over
+            files.splice(files.end(), ifiles);
+            break;
+        }
+        LOG_INF(("* early merge of %d runs") % ifiles.size());
+
+        // a single merge of kmerge runs with the other half of the memory,
+        // its output is one more run for the final merge
+        MergeParams params;
+        params.mem = mp.mem;
+        params.mem.size = mem - mem / 2;
+        params.mem.unit = B;
+        params.mrg = mp.mrg;
+        params.mrg.merges = 1;
+        params.mrg.parts = 1;
+        params.mrg.plan = false;
+        params.mrg.encode = mp.mrg.encode && mp.mrg.parts <= 1;
+        params.mrg.tmp_ofile = true;
+        params.mrg.ifiles = ifiles;
+        params.mrg.iencoded = encoded;
+        params.mrg.ofile = make_tmp_filename(
+            (mp.mrg.tfile.size() ? mp.mrg.tfile : mp.mrg.ofile),
+            "early", ++file_cnt);
+        merge<ValueType>(params);
+        // (a single run is not merged but renamed, as it is)
+        if (ifiles.size() > 1 ? params.mrg.encode
+                              : encoded.count(ifiles.front()) > 0) {
+            encoded.insert(params.mrg.ofile);
+        }
+
+        if (params.err) {
+            mp.err.none = false;
+            mp.err.stream << params.err.msg();
+            // (whatever is left of the merge is removed below)
+            files.splice(files.end(), ifiles);
+        }
+        files.push_back(params.mrg.ofile);
+    }
+    tsplit.join();
+    sp.mem = sp_mem;
+    sp.out.ready = nullptr;
+
+    if (sp.err.none && mp.err.none) {
+        mp.mrg.ifiles = files;
+        mp.mrg.iencoded = encoded;
+        merge<ValueType>(mp, sink);
+    } else {
+        // nothing is merged: remove the runs written after the error
+        // and the runs and early merges collected so far
+        for (const auto& run : runs.Pop(std::numeric_limits<size_t>::max())) {
+            files.push_back(run.first);
+        }
+        for (const auto& file : files) {
+            remove(file.c_str());
+        }
+    }
+}
+
+//! Keeps the n smallest values of the input in memory, so the input is read
+//! just once: the values are collected into a buffer (of at least 2n); each
+//! time it's full, it's sorted and cut down to n values, and from then on
+//! the values greater than the n-th one are skipped right away
+template <typename ValueType>
+void topk_memory(SplitParams& sp, MergeParams& mp, size_t n, size_t capacity)
+{
+    TRACE_FUNC();
+    auto comp = typename Types<ValueType>::Comparator();
+    size_t mem_stream = memsize_in_bytes(sp.mem.size, sp.mem.unit) / 4;
+
+    auto pool = std::make_shared<typename Types<ValueType>::BlockPool>(
+        capacity * sizeof(ValueType), 1);
+    auto values = pool->Allocate();
+
+    auto istream = std::make_shared<typename Types<ValueType>::IStream>();
+    istream->set_mem_pool(mem_stream, sp.mem.blocks);
+    istream->set_input_filename(sp.spl.ifile);
+    istream->set_input_rm_file(sp.spl.rm_input);
+    istream->set_input_range(sp.spl.ioffset, sp.spl.isize);
+    istream->set_input_drop_cache(drop_cache(sp.mem, CACHE_INPUT));
+    istream->Open();
+
+    // the sort is split into tasks of the workers (and this thread)
+    std::unique_ptr<aux::AsyncFuncs<bool>> workers;
+    if (sp.spl.threads > 1) {
+        workers.reset(new aux::AsyncFuncs<bool>(sp.spl.threads - 1));
+    }
+
+    // sorts the values and keeps the n smallest ones
+    auto cut = [&] () {
+        sort_block<ValueType>(values->begin(), values->end(), sp.spl.threads,
+                              workers.get());
+        combine_block<ValueType>(*values);
+        if (values->size() > n) {
+            values->resize(n);
+        }
+    };
+
+    ValueType bound = ValueType();
+    bool has_bound = false;
+    while (!istream->Empty()) {
+        const auto& value = istream->Front();
+        if (!has_bound || !comp(bound, value)) {
+            values->push_back(value);
+            if (values->size() == values->capacity()) {
+                cut();
+                if (values->size() == n) {
+                    bound = values->back();
+                    has_bound = true;
+                }
+            }
+        }
+        istream->Pop();
+    }
+    cut();
+    istream->Close();
+    if (report_input_failure(sp.err, istream)) {
+        pool->Free(values);
+        return;
+    }
+
+    auto ostream = std::make_shared<typename Types<ValueType>::OStream>();
+    ostream->set_mem_pool(mem_stream, sp.mem.blocks);
+    ostream->set_output_filename(mp.mrg.ofile);
+    ostream->set_output_drop_cache(drop_cache(mp.mem, CACHE_OUTPUT));
+    ostream->Open();
+    ostream->Push(values->begin(), values->end());
+    ostream->Close();
+    pool->Free(values);
+    if (report_output_failure(mp.err, ostream)) {
+        return;
+    }
+    LOG_IMP(("Output file: %s") % mp.mrg.ofile);
+}
+
+/// ----------------------------------------------------------------------------
+/// main external sorting functions
+
+//! External Split
+template <typename ValueType>
+void split(SplitParams& params)
+{
+    TRACE_FUNC();
+    if (params.spl.ofile.empty()) {
+        // if no output prefix given, use input filename as a prefix
+        params.spl.ofile = params.spl.ifile;
+    }
+
+    if (params.spl.readers > 1) {
+        split_parallel<ValueType>(params);
+    } else if (params.spl.rsel) {
+        split_rsel<ValueType>(params);
+    } else {
+        split_blocks<ValueType>(params);
+    }
+}
+
+// Simulates merging the files (sizes in bytes) k at a time, smallest first
+// with a padded first merge (as merge() does); returns the number of bytes
+// read by all merges and the number of passes (merges on the longest path)
+inline std::pair<size_t, size_t> plan_passes(const std::vector<size_t>& sizes,
+                                             size_t kmerge)
+{
+    std::multimap<size_t, size_t> files;    // size => passes to make it
+    for (const auto& size : sizes) {
+        files.emplace(size, 0);
+    }
+    if (files.size() < 2) {
+        return std::make_pair(0, 0);
+    }
+
+    size_t bytes = 0;
+    size_t k = (files.size() - 2) % (kmerge - 1) + 2;
+    while (files.size() > 1) {
+        size_t size = 0, passes = 0;
+        for (size_t i = 0; i < k && !files.empty(); i++) {
+            size += files.begin()->first;
+            passes = std::max(passes, files.begin()->second);
+            files.erase(files.begin());
+        }
+        bytes += size;
+        files.emplace(size, passes + 1);
+        k = kmerge;
+    }
+    return std::make_pair(bytes, files.begin()->second);
+}
+
+// Chooses the number of simultaneous merges, the number of streams merged
+// at a time and the number of read-ahead blocks: the fewest passes over the
+// data, such that the input blocks are not smaller than mrg.ioblock, and
+// for that many passes, as many simultaneous merges (up to the hardware
+// threads) as the first pass can use, even if each merges fewer streams
+template <typename ValueType>
+void plan_merge(MergeParams& params)
+{
+    TRACE_FUNC();
+    std::vector<size_t> sizes;
+    size_t total = 0;
+    for (const auto& file : params.mrg.ifiles) {
+        sizes.push_back(file_size(file));
+        total += sizes.back();
+    }
+    size_t nfiles = std::max<size_t>(sizes.size(), 2);
+    size_t mem = memsize_in_bytes(params.mem.size, params.mem.unit);
+    size_t ioblock = std::max<size_t>(params.mrg.ioblock, sizeof(ValueType));
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+    // half of the memory of a merge goes to the input streams: a block
+    // per stream and at least 2 read-ahead blocks (merge_pool_blocks)
+    size_t best_merges = 1, best_kmerge = 2;
+    std::pair<size_t, size_t> best_plan;    // bytes merged, passes
+    for (size_t merges = 1; merges <= cores; merges++) {
+        size_t blocks = mem / merges / 2 / ioblock;
+        size_t kmerge = (blocks > 4) ? blocks - 2 : 2;
+        kmerge = std::min(kmerge, nfiles);
+        auto plan = plan_passes(sizes, kmerge);
+        // more simultaneous merges than merges in the first pass is useless
+        if (merges > 1 && merges > (nfiles + kmerge - 1) / kmerge) {
+            break;
+        }
+        // as many passes with more simultaneous merges is better
+        if (best_plan.second == 0 || plan.second <= best_plan.second) {
+            best_merges = merges;
+            best_kmerge = kmerge;
+            best_plan = plan;
+        }
+    }
+    size_t blocks = mem / best_merges / 2 / ioblock;
+    if (blocks < best_kmerge + 2) {
+        LOG_INF(("* merge plan: not enough memory for %d byte blocks")
+                % ioblock);
+    }
+
+    // spare memory goes to more read-ahead blocks (up to 4), the rest
+    // makes the blocks larger
+    size_t stmblocks = (blocks > best_kmerge) ? blocks - best_kmerge : 0;
+    stmblocks = std::min<size_t>(std::max<size_t>(stmblocks, 2), 4);
+
+    params.mrg.merges = best_merges;
+    params.mrg.kmerge = best_kmerge;
+    params.mrg.stmblocks = stmblocks;
+
+    LOG_IMP(("* merge plan: merges = %d, kmerge = %d, stmblocks = %d")
+            % best_merges % best_kmerge % stmblocks);
+    LOG_IMP(("* merge plan: %d files, %d bytes: %d passes, "
+             "%d bytes read and written")
+            % sizes.size() % total % best_plan.second % (2 * best_plan.first));
 }
 
 //! External Merge
+//! If a sink is given, the final merge hands the sorted values over to it
+//! block by block (instead of writing them to mrg.ofile)
 template <typename ValueType>
-void merge(MergeParams& params)
+void merge(MergeParams& params, typename Types<ValueType>::Sink sink)
 {
     TRACE_FUNC();
     size_t file_cnt = 0;
 
-    aux::AsyncFuncs<typename Types<ValueType>::OStreamPtr> merges;
+    if (params.mrg.plan) {
+        plan_merge<ValueType>(params);
+    }
+
+    // combined or limited parts shrink, so their offsets in the output are
+    // not known in advance: the final merge can't be cut into parts
+    if ((CombinerTraits<ValueType>::enabled || params.mrg.limit) &&
+        params.mrg.parts > 1) {
+        LOG_INF(("* merge: parts = 1 (values are combined or limited)"));
+        params.mrg.parts = 1;
+    }
+
+    // encoded runs have no value at a byte offset: the final merge can't
+    // be cut into parts either
+    bool iencoded = !params.mrg.iencoded.empty() && Types<ValueType>::ENCODED;
+    if (params.mrg.parts > 1 && iencoded) {
+        LOG_INF(("* merge: parts = 1 (runs are encoded)"));
+        params.mrg.parts = 1;
+    }
+
+    aux::AsyncFuncs<typename Types<ValueType>::OStreamPtr> merges(
+        params.mrg.merges);
 
     size_t mem_merge = memsize_in_bytes(params.mem.size, params.mem.unit) /
                        params.mrg.merges;
     size_t mem_ostream = mem_merge / 2;
-    size_t mem_istream = mem_merge - mem_ostream;
+    size_t mem_istream = mem_merge - mem_ostream -
+        merge_kernel_memory<ValueType, typename Types<ValueType>::Comparator>(
+            params.mrg.kmerge);
+
+    // The final merge of up to kmerge files can be split into key ranges
+    // merged in parallel (parts) or go to the sink; otherwise merge down
+    // to a single file
+    size_t files_final = (params.mrg.parts > 1 || sink) ? params.mrg.kmerge
+                                                       : 1;
+
+    // Files to merge ordered by size: the smallest files are merged first
+    // (Huffman-style), so big files are not re-merged over and over again
+    std::multimap<size_t, std::string> files;
+    for (const auto& file : params.mrg.ifiles) {
+        files.emplace(file_size(file), file);
+    }
+
+    // Files written encoded: the input runs (if so) and the intermediate
+    // files of the merge that are encoded; any other file is read raw
+    std::unordered_set<std::string> encoded;
+    if (iencoded) {
+        encoded = params.mrg.iencoded;
+    }
+
+    // The first merge takes only as many files as needed for all further
+    // merges (including the final one) to take exactly kmerge files
+    size_t kmerge = params.mrg.kmerge;
+    if (files.size() > params.mrg.kmerge && params.mrg.kmerge > 1) {
+        kmerge = (files.size() - 2) % (params.mrg.kmerge - 1) + 2;
+    }
 
     // Merge files while there is something to merge or there are ongoing merges
-    auto files = params.mrg.ifiles;
-    while (files.size() > 1 || !merges.Empty()) {
+    size_t bytes_merged = 0;
+    std::vector<std::string> outputs;
+    while ((files.size() > files_final && params.err.none) ||
+           !merges.Empty()) {
         LOG_INF(("* files left to merge %d") % files.size());
 
-        // create a set of input streams with next kmerge files from the queue
-        std::unordered_set<typename Types<ValueType>::IStreamPtr> istreams;
-        while (istreams.size() < params.mrg.kmerge && !files.empty()) {
+        // the input streams of this merge share the read-ahead blocks
+        kmerge = std::min(kmerge, files.size());
+        auto pool = std::make_shared<typename Types<ValueType>::MStreamPool>(
+            mem_istream, merge_pool_blocks(params, kmerge));
+
+        // create a set of input streams with next kmerge smallest files
+        std::unordered_set<typename Types<ValueType>::MStreamPtr> istreams;
+        while (istreams.size() < kmerge && !files.empty()) {
             // create input stream
-            auto is = std::make_shared<typename Types<ValueType>::IStream>();
-            is->set_mem_pool(mem_istream, params.mrg.stmblocks);
-            is->set_input_filename(files.front());
+            auto is = std::make_shared<typename Types<ValueType>::MStream>();
+            is->set_mem_pool(pool);
+            is->set_input_filename(files.begin()->second);
+            is->set_input_encoded(encoded.count(files.begin()->second) > 0);
             is->set_input_rm_file(params.mrg.rm_input);
+            is->set_input_range(0, params.mrg.limit * sizeof(ValueType));
+            is->set_input_drop_cache(
+                drop_cache(params.mem, merge_input_role(params)));
             // add to the set
             istreams.insert(is);
-            files.pop_front();
+            bytes_merged += files.begin()->first;
+            files.erase(files.begin());
         }
+        kmerge = params.mrg.kmerge;
 
         // create an output stream
         auto ostream = std::make_shared<typename Types<ValueType>::OStream>();
@@ -155,11 +1205,21 @@ void merge(MergeParams& params)
         ostream->set_output_filename(make_tmp_filename(
             (params.mrg.tfile.size() ? params.mrg.tfile : params.mrg.ofile),
             DEF_MRG_TMP_SFX, ++file_cnt));
+        outputs.push_back(ostream->output_filename());
+        // (the last merge writes the output, it's just renamed then;
+        // unless the output is merged further)
+        bool last = files.empty() && merges.Empty() && files_final == 1 &&
+                    !params.mrg.tmp_ofile;
+        ostream->set_output_drop_cache(
+            drop_cache(params.mem, last ? CACHE_OUTPUT : CACHE_TEMP));
+        ostream->set_output_encoded(params.mrg.encode && !last &&
+                                    params.mrg.parts <= 1);
 
         // asynchronously merge and write to the output stream
-        merges.Async(&merge_streams<typename Types<ValueType>::IStreamPtr,
+        merges.Async(&merge_streams<typename Types<ValueType>::MStreamPtr,
                                     typename Types<ValueType>::OStreamPtr>,
-                     std::move(istreams), std::move(ostream));
+                     std::move(istreams), std::move(ostream),
+                     params.mrg.limit);
 
         // Wait/get results of asynchroniously running merges if:
         // 1) Too few files ready to be merged, while still running merges.
@@ -171,35 +1231,116 @@ void merge(MergeParams& params)
                (merges.Ready() > 0) || (merges.Running() >= params.mrg.merges)) {
             auto ostream_ready = merges.GetAny();
             if (ostream_ready) {
-                files.push_back(ostream_ready->output_filename());
+                const auto& file = ostream_ready->output_filename();
+                files.emplace(file_size(file), file);
+                if (ostream_ready->output_encoded()) {
+                    encoded.insert(file);
+                }
+            } else if (params.err.none) {
+                params.err.none = false;
+                params.err.stream << "Merge failed. An input run is "
+                                     "truncated or corrupted, or the output "
+                                     "not written";
             }
         }
     }
+    LOG_INF(("* intermediate merges read %d bytes") % bytes_merged);
 
-    if (files.size()) {
-        if (rename(files.front().c_str(), params.mrg.ofile.c_str()) == 0) {
+    if (params.err) {
+        // nothing more is merged: remove the intermediate files (also
+        // the output of the failed merge) and the inputs left, if the
+        // merge owns them (it'd remove them when done)
+        for (const auto& file : outputs) {
+            remove(file.c_str());
+        }
+        if (params.mrg.rm_input) {
+            for (const auto& file : files) {
+                remove(file.second.c_str());
+            }
+        }
+    } else if (files.size() && sink) {
+        merge_to_sink<ValueType>(params, files, encoded, sink);
+    } else if (files.size() > 1) {
+        std::vector<std::string> files_final;
+        for (const auto& file : files) {
+            files_final.push_back(file.second);
+        }
+        merge_parallel<ValueType>(params, files_final);
+    } else if (files.size() && !params.mrg.tmp_ofile &&
+               encoded.count(files.begin()->second)) {
+        decode_file<ValueType>(params, files.begin()->second);
+    } else if (files.size()) {
+        const auto& file = files.begin()->second;
+        if (rename(file.c_str(), params.mrg.ofile.c_str()) == 0) {
             LOG_IMP(("Output file: %s") % params.mrg.ofile);
         } else {
             params.err.none = false;
-            params.err.stream << "Cannot rename " << files.front()
+            params.err.stream << "Cannot rename " << file
                               << " to " << params.mrg.ofile;
         }
-    } else {
-        params.err.none = false;
-        params.err.stream << "Merge failed. No input";
+    } else if (!sink) {
+        // no runs at all (an empty input): the output is empty
+        int fd = ::open(params.mrg.ofile.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            params.err.none = false;
+            params.err.stream << "Cannot create " << params.mrg.ofile << " ("
+                              << strerror(errno) << ")";
+            return;
+        }
+        ::close(fd);
+        LOG_IMP(("Output file: %s") % params.mrg.ofile);
     }
 }
 
 //! External Sort (= Split + Merge)
 template <typename ValueType>
-void sort(SplitParams& sp, MergeParams& mp)
+void sort(SplitParams& sp, MergeParams& mp,
+          typename Types<ValueType>::Sink sink = nullptr)
 {
-    split<ValueType>(sp);
+    // the runs are temporary files of the merge: encoded as its other
+    // temporary files, unless merged in parts (read at byte offsets)
+    sp.spl.encode = mp.mrg.encode && mp.mrg.parts <= 1;
+    // (a single run, e.g. of a sorted input, is raw and just renamed)
+    sp.spl.raw_first = true;
 
-    if (sp.err.none) {
-        mp.mrg.ifiles = sp.out.ofiles;
-        merge<ValueType>(mp);
+    if (mp.mrg.overlap) {
+        sort_overlap<ValueType>(sp, mp, sink);
+    } else {
+        split<ValueType>(sp);
+
+        if (sp.err.none) {
+            mp.mrg.ifiles = sp.out.ofiles;
+            mp.mrg.iencoded = sp.out.oencoded;
+            merge<ValueType>(mp, sink);
+        }
+    }
+
+    // the runs merged (early or not) are removed: only the ones left
+    // are reported
+    remove_gone_files(sp.out.ofiles);
+}
+
+//! External Top-k: the n smallest values of the input (sorted) to
+//! mrg.ofile, i.e. the first n values sort() would output (n = 0: all).
+//! If 2n values fit into half of the memory, the input is read just once.
+//! Otherwise, every run and every merge output keeps its first n values
+//! only, so the merge reads at most n values of each file
+template <typename ValueType>
+void topk(SplitParams& sp, MergeParams& mp, size_t n)
+{
+    size_t mem = memsize_in_bytes(sp.mem.size, sp.mem.unit);
+    size_t capacity = sort_blocks_memsize<ValueType>(
+        mem - mem / 2, 1, sp.spl.threads) / sizeof(ValueType);
+    if (n && n <= capacity / 2) {
+        LOG_INF(("* top-k: %d values kept in memory") % n);
+        topk_memory<ValueType>(sp, mp, n, capacity);
+        return;
     }
+
+    sp.spl.limit = n;
+    mp.mrg.limit = n;
+    sort<ValueType>(sp, mp);
 }
 
 //! External Check
@@ -214,6 +1355,7 @@ bool check(CheckParams& params)
     istream->set_mem_pool(memsize_in_bytes(params.mem.size, params.mem.unit),
                           params.mem.blocks);
     istream->set_input_filename(params.chk.ifile);
+    istream->set_input_drop_cache(drop_cache(params.mem, CACHE_INPUT));
     istream->Open();
 
     size_t cnt = 0, bad = 0;
@@ -258,12 +1400,15 @@ bool check(CheckParams& params)
     params.err.stream << "\tsorted = " << ((bad) ? "false" : "true")
                       << ", elems = " << cnt << ", bad = " << bad;
     istream->Close();
+    if (report_input_failure(params.err, istream)) {
+        return false;
+    }
     return bad == 0;
 }
 
 //! External Generate
 template <typename ValueType>
-void generate(const GenerateParams& params)
+void generate(GenerateParams& params)
 {
     TRACE_FUNC();
 
@@ -275,6 +1420,7 @@ void generate(const GenerateParams& params)
     ostream->set_mem_pool(memsize_in_bytes(params.mem.size, params.mem.unit),
                           params.mem.blocks);
     ostream->set_output_filename(params.gen.ofile);
+    ostream->set_output_drop_cache(drop_cache(params.mem, CACHE_OUTPUT));
     ostream->Open();
 
     for (size_t i = 0; i < gen_elements; i++) {
@@ -282,6 +1428,7 @@ void generate(const GenerateParams& params)
     }
 
     ostream->Close();
+    report_output_failure(params.err, ostream);
 }
 
 } // namespace external_sort
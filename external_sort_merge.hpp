@@ -1,20 +1,260 @@
 #ifndef EXTERNAL_SORT_MERGE_HPP
 #define EXTERNAL_SORT_MERGE_HPP
 
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "external_sort_simd.hpp"
+
 namespace external_sort {
 
-// merges 1 stream (simple copy)
+// a stream winning this many times in a row switches the merge to galloping
+const size_t MERGE_GALLOP_STREAK = 7;
+
+// merges 1 stream (simple copy, block by block)
 template <typename InputStream, typename OutputStream>
 void copy_stream(InputStream* sin, OutputStream* sout)
 {
     TRACE_FUNC();
     while (!sin->Empty()) {
-        sout->Push(sin->Front());
-        sin->Pop();
+        auto last = sin->FrontEnd();
+        sout->Push(sin->FrontBegin(), last);
+        sin->Pop(last);
+    }
+}
+
+// Returns the end of the values of the sorted range [first, last) that are
+// not greater than bound; *first must not be greater than bound. If the
+// whole range fits, it's last; otherwise the cut is found by an exponential
+// search (galloping) from first followed by a binary search, so the cost
+// grows with the log of the distance to the cut, not of the range
+template <typename Iterator, typename ValueType, typename Comparator>
+Iterator gallop_bound(Iterator first, Iterator last, const ValueType& bound,
+                      Comparator comp)
+{
+    if (!comp(bound, *(last - 1))) {
+        return last;
+    }
+    // invariant: *lo <= bound
+    auto lo = first;
+    size_t step = 1;
+    while (step < size_t(last - lo) && !comp(bound, *(lo + step))) {
+        lo += step;
+        step *= 2;
+    }
+    auto hi = (step < size_t(last - lo)) ? lo + step : last;
+    return std::upper_bound(lo + 1, hi, bound, comp);
+}
+
+// Moves the values of the current block of the stream that are not greater
+// than bound (the smallest head of the other streams) in bulk to the output
+// (see gallop_bound). The stream's front must not be greater than bound.
+// Used by the scalar kernels; the nodes of the SIMD merge tree gallop
+// through their children the same way (see MergeTreeNode)
+template <typename InputStream, typename OutputStream, typename Comparator>
+void gallop_stream(InputStream* s, OutputStream* sout,
+                   const typename InputStream::ValueType& bound,
+                   Comparator comp)
+{
+    auto first = s->FrontBegin();
+    auto cut = gallop_bound(first, s->FrontEnd(), bound, comp);
+    sout->Push(first, cut);
+    s->Pop(cut);
+}
+
+// returns the smallest head of the streams other than the given one
+template <typename InputStream, typename Comparator>
+const typename InputStream::ValueType& min_front_except(
+    StreamSet<InputStream*>& sin, InputStream* except, Comparator comp)
+{
+    const typename InputStream::ValueType* vmin = nullptr;
+    for (auto s : sin) {
+        if (s != except && (!vmin || comp(s->Front(), *vmin))) {
+            vmin = &s->Front();
+        }
+    }
+    return *vmin;
+}
+
+// the largest number of streams merged by a kernel generated for it
+const size_t MERGE_KSTREAMS_MAX = 16;
+
+template <typename InputStream, typename OutputStream, typename Comparator>
+void merge_kernel(StreamSet<InputStream*>& sin, OutputStream* sout,
+                  Comparator comp);
+
+// values of each child merged at a time by a node of the SIMD merge tree
+const size_t MERGE_TREE_CHUNK = 512;
+
+// values of a child preceding the other child's front from which a node of
+// the SIMD merge tree gallops (passes them through instead of merging)
+const size_t MERGE_TREE_GALLOP = 64;
+
+// memory the SIMD merge tree of k streams takes besides the streams (the
+// buffers of its k - 1 inner nodes); it's left out of the memory of the
+// input streams
+template <typename ValueType, typename Comparator>
+size_t merge_kernel_memory(size_t k)
+{
+    return (simd::enabled<ValueType, Comparator>() && k > 1)
+               ? (k - 1) * 2 * MERGE_TREE_CHUNK * sizeof(ValueType) : 0;
+}
+
+// Node of a merge tree of 2-way SIMD merges. A leaf reads an input stream;
+// an inner node merges the values of its two children into a small buffer,
+// chunk by chunk: all values up to the smaller of the two chunks' last
+// values are known to precede anything not merged yet, so they are merged
+// at once. If the first MERGE_TREE_GALLOP values of a child precede the
+// other child's front, the children don't overlap there: the node gallops,
+// i.e. the ready values of the child up to that front, found by exponential
+// search (gallop_bound), are passed through as they are (no merge, no
+// copy), however many there are. Once a child is over, the node passes the
+// other one through. The ready values of a node are the range
+// [Begin(), End())
+template <typename InputStream, typename Comparator>
+class MergeTreeNode
+{
+  public:
+    using ValueType = typename InputStream::ValueType;
+
+    MergeTreeNode(InputStream* s, Comparator comp)
+        : stream_(s), comp_(comp) {}
+    MergeTreeNode(MergeTreeNode* left, MergeTreeNode* right, Comparator comp)
+        : left_(left), right_(right), buf_(2 * MERGE_TREE_CHUNK),
+          comp_(comp) {}
+
+    bool Fill();                        // false if no values are left
+    void Pop(const ValueType* last);    // pops the values up to last
+    const ValueType* Begin() const { return begin_; }
+    const ValueType* End() const { return end_; }
+
+  private:
+    InputStream* stream_ = {nullptr};
+    MergeTreeNode* left_ = {nullptr};
+    MergeTreeNode* right_ = {nullptr};
+    MergeTreeNode* pass_ = {nullptr};
+    MergeTreeNode* from_ = {nullptr};   // child passed through, if any
+    std::vector<ValueType> buf_;
+    const ValueType* begin_ = {nullptr};
+    const ValueType* end_ = {nullptr};
+    Comparator comp_;
+};
+
+template <typename InputStream, typename Comparator>
+bool MergeTreeNode<InputStream, Comparator>::Fill()
+{
+    if (begin_ != end_) {
+        return true;
+    }
+    if (stream_) {
+        // leaf: the values left in the current block of the stream
+        if (stream_->Empty()) {
+            return false;
+        }
+        begin_ = &*stream_->FrontBegin();
+        end_ = begin_ + (stream_->FrontEnd() - stream_->FrontBegin());
+        return true;
+    }
+    if (!pass_ && !(left_->Fill() && right_->Fill())) {
+        pass_ = left_->Fill() ? left_ : right_;
+    }
+    if (pass_) {
+        if (!pass_->Fill()) {
+            return false;
+        }
+        from_ = pass_;
+        begin_ = pass_->Begin();
+        end_ = pass_->End();
+        return true;
+    }
+
+    auto a = left_->Begin();
+    auto b = right_->Begin();
+    auto ag = a + std::min<size_t>(left_->End() - a, MERGE_TREE_GALLOP);
+    if (!comp_(*b, *(ag - 1))) {
+        from_ = left_;
+        begin_ = a;
+        end_ = gallop_bound(ag - 1, left_->End(), *b, comp_);
+        return true;
+    }
+    auto bg = b + std::min<size_t>(right_->End() - b, MERGE_TREE_GALLOP);
+    if (!comp_(*a, *(bg - 1))) {
+        from_ = right_;
+        begin_ = b;
+        end_ = gallop_bound(bg - 1, right_->End(), *a, comp_);
+        return true;
+    }
+
+    auto ae = a + std::min<size_t>(left_->End() - a, MERGE_TREE_CHUNK);
+    auto be = b + std::min<size_t>(right_->End() - b, MERGE_TREE_CHUNK);
+
+    auto ac = ae, bc = be;
+    if (comp_(*(be - 1), *(ae - 1))) {
+        ac = std::upper_bound(a, ae, *(be - 1), comp_);
+    } else {
+        bc = std::upper_bound(b, be, *(ae - 1), comp_);
+    }
+    from_ = nullptr;
+    begin_ = buf_.data();
+    end_ = simd::merge(a, ac, b, bc, buf_.data(), comp_);
+    left_->Pop(ac);
+    right_->Pop(bc);
+    return true;
+}
+
+template <typename InputStream, typename Comparator>
+void MergeTreeNode<InputStream, Comparator>::Pop(const ValueType* last)
+{
+    if (stream_ && last != begin_) {
+        stream_->Pop(stream_->FrontBegin() + (last - begin_));
+    } else if (from_) {
+        from_->Pop(last);
+    }
+    begin_ = last;
+}
+
+// Merges the streams of numeric values with a balanced tree of 2-way SIMD
+// merges (see MergeTreeNode); the values flow up the tree in chunks small
+// enough to stay in the L1 cache
+template <typename InputStream, typename OutputStream, typename Comparator>
+void merge_tree_simd(StreamSet<InputStream*>& sin, OutputStream* sout,
+                     Comparator comp)
+{
+    TRACE_FUNC();
+    using Node = MergeTreeNode<InputStream, Comparator>;
+
+    // the leaves, then the inner nodes level by level up to the root
+    std::vector<Node> nodes;
+    nodes.reserve(2 * sin.size() - 1);
+    std::vector<Node*> level;
+    for (auto s : sin) {
+        nodes.emplace_back(s, comp);
+        level.push_back(&nodes.back());
     }
+    while (level.size() > 1) {
+        std::vector<Node*> up;
+        for (size_t i = 0; i + 1 < level.size(); i += 2) {
+            nodes.emplace_back(level[i], level[i + 1], comp);
+            up.push_back(&nodes.back());
+        }
+        if (level.size() % 2) {
+            // the odd node goes up as it is
+            up.push_back(level.back());
+        }
+        level.swap(up);
+    }
+
+    Node* root = level.front();
+    while (root->Fill()) {
+        sout->Push(root->Begin(), root->End());
+        root->Pop(root->End());
+    }
+    sin.clear();
 }
 
-// merges 2 streams
+// merges 2 streams by comparing their fronts (the kernel of
+// merge_kstreams<2>: no tree is needed for a single match)
 template <typename InputStream, typename OutputStream, typename Comparator>
 void merge_2streams(StreamSet<InputStream*>& sin, OutputStream* sout,
                     Comparator comp)
@@ -29,11 +269,20 @@ void merge_2streams(StreamSet<InputStream*>& sin, OutputStream* sout,
     InputStream* s1 = *(it++);
     InputStream* s2 = *(it++);
     InputStream* smin = s1;
+    InputStream* slast = nullptr;
+    size_t streak = 0;
 
     for (;;) {
         smin = comp(s1->Front(), s2->Front()) ? s1 : s2;
-        sout->Push(smin->Front());
-        smin->Pop();
+        streak = (smin == slast) ? streak + 1 : 1;
+        slast = smin;
+        if (streak < MERGE_GALLOP_STREAK) {
+            sout->Push(smin->Front());
+            smin->Pop();
+        } else {
+            gallop_stream(smin, sout, (smin == s1 ? s2 : s1)->Front(), comp);
+            streak = 0;
+        }
         if (smin->Empty()) {
             sin.erase(smin);
             break;
@@ -42,129 +291,365 @@ void merge_2streams(StreamSet<InputStream*>& sin, OutputStream* sout,
     copy_stream(*sin.begin(), sout);
 }
 
-// merges 3 streams
-template <typename InputStream, typename OutputStream, typename Comparator>
-void merge_3streams(StreamSet<InputStream*>& sin, OutputStream* sout,
+// Head of a stream in a merge kernel: a copy of the front value for scalar
+// types (no indirection when comparing), a pointer to it for records
+template <typename ValueType, bool = std::is_scalar<ValueType>::value>
+struct MergeHead
+{
+    const ValueType* value;
+    void Set(const ValueType& v) { value = &v; }
+    const ValueType& Get() const { return *value; }
+};
+
+template <typename ValueType>
+struct MergeHead<ValueType, true>
+{
+    ValueType value;
+    void Set(const ValueType& v) { value = v; }
+    const ValueType& Get() const { return value; }
+};
+
+// Merges exactly K streams (K = 2 to MERGE_KSTREAMS_MAX, known at compile
+// time) with a loser tree kept in local arrays. All K streams are live, so
+// the tree needs no sentinels, and the matches on the way to the root are
+// replayed without branches (the swap of the winner and the loser is
+// masked): log2(K) comparisons per value, where a branchless min over the
+// heads takes K - 1 and is slower from 8 streams on. Two streams play a
+// single match, so they just compare their fronts (merge_2streams). When a
+// stream runs out, the rest goes back to merge_kernel (to the kernel for
+// K - 1). These kernels merge records, other types and comparators, and
+// values on CPUs without SIMD; the values the SIMD merge tree takes (the
+// default uint32_t) never get here (see merge_kernel)
+template <size_t K, typename InputStream, typename OutputStream,
+          typename Comparator>
+void merge_kstreams(StreamSet<InputStream*>& sin, OutputStream* sout,
                     Comparator comp)
 {
     TRACE_FUNC();
-    if (sin.size() != 3) {
+    using ValueType = typename InputStream::ValueType;
+    if (sin.size() != K) {
         LOG_ERR(("Internal error: mismatch in number of streams %d/%d")
-                % sin.size() % 3);
+                % sin.size() % K);
+        return;
+    }
+    if (K == 2) {
+        merge_2streams(sin, sout, comp);
         return;
     }
-    auto it = sin.begin();
-    InputStream* s1 = *(it++);
-    InputStream* s2 = *(it++);
-    InputStream* s3 = *(it++);
-    InputStream* smin = s1;
 
+    InputStream* streams[K];
+    MergeHead<ValueType> heads[K];
+    size_t n = 0;
+    for (auto s : sin) {
+        streams[n] = s;
+        heads[n].Set(s->Front());
+        n++;
+    }
+    auto less = [ &comp, &heads ] (size_t x, size_t y) {
+        return comp(heads[x].Get(), heads[y].Get());
+    };
+
+    // the leaf i is the node (K + i), the node k has children 2k and 2k + 1
+    size_t tree[K];
+    size_t winners[2 * K];
+    for (size_t i = 0; i < K; i++) {
+        winners[K + i] = i;
+    }
+    for (size_t k = K - 1; k > 0; k--) {
+        size_t x = winners[2 * k], y = winners[2 * k + 1];
+        bool swap = less(y, x);
+        winners[k] = swap ? y : x;
+        tree[k] = swap ? x : y;
+    }
+    tree[0] = winners[1];
+
+    size_t slast = K, streak = 0;
     for (;;) {
-        if (comp(s1->Front(),s2->Front())) {
-            smin = comp(s1->Front(), s3->Front()) ? s1 : s3;
+        size_t smin = tree[0];
+        InputStream* s = streams[smin];
+        streak = (smin == slast) ? streak + 1 : 1;
+        slast = smin;
+        if (streak < MERGE_GALLOP_STREAK) {
+            sout->Push(heads[smin].Get());
+            s->Pop();
         } else {
-            smin = comp(s2->Front(), s3->Front()) ? s2 : s3;
+            // the runner-up is the best of the losers on the winner's path
+            size_t srunner = tree[(smin + K) / 2];
+            for (size_t k = (smin + K) / 4; k > 0; k /= 2) {
+                srunner = less(tree[k], srunner) ? tree[k] : srunner;
+            }
+            gallop_stream(s, sout, heads[srunner].Get(), comp);
+            streak = 0;
         }
-        sout->Push(smin->Front());
-        smin->Pop();
-        if (smin->Empty()) {
-            sin.erase(smin);
+        if (s->Empty()) {
+            sin.erase(s);
             break;
         }
+        heads[smin].Set(s->Front());
+
+        // replay the matches on the way from the leaf to the root:
+        // mask is all ones if the loser wins, then the two are swapped
+        size_t winner = smin;
+        for (size_t k = (smin + K) / 2; k > 0; k /= 2) {
+            size_t loser = tree[k];
+            size_t mask = size_t(0) - size_t(less(loser, winner));
+            size_t diff = (loser ^ winner) & mask;
+            tree[k] = loser ^ diff;
+            winner ^= diff;
+        }
+        tree[0] = winner;
     }
-    merge_2streams(sin, sout, comp);
+    merge_kernel(sin, sout, comp);
 }
 
-// merges 4 streams
+// merges n streams with a tournament tree of losers (loser tree):
+// each node keeps the loser of the match played in it and the winner goes
+// up to the next match, so every value costs about log2(n) comparisons.
+// The heads of the streams are cached (pointers to their front values);
+// an exhausted stream has no head and loses every match (sentinel).
+// If the same stream keeps winning, its values are moved in bulk up to the
+// runner-up, which is the best of the losers on the winner's path.
+// Once few enough streams are left, they go to a fixed-K kernel
 template <typename InputStream, typename OutputStream, typename Comparator>
-void merge_4streams(StreamSet<InputStream*>& sin, OutputStream* sout,
+void merge_nstreams(StreamSet<InputStream*>& sin, OutputStream* sout,
                     Comparator comp)
 {
     TRACE_FUNC();
-    if (sin.size() != 4) {
-        LOG_ERR(("Internal error: mismatch in number of streams %d/%d")
-                % sin.size() % 4);
-        return;
+    using ValueType = typename InputStream::ValueType;
+
+    std::vector<InputStream*> streams(sin.begin(), sin.end());
+    std::vector<const ValueType*> heads;
+    for (auto& s : streams) {
+        heads.push_back(s->Empty() ? nullptr : &s->Front());
     }
-    auto it = sin.begin();
-    InputStream* s1 = *(it++);
-    InputStream* s2 = *(it++);
-    InputStream* s3 = *(it++);
-    InputStream* s4 = *(it++);
-    InputStream* smin = s1;
+    auto less = [ &comp, &heads ] (size_t x, size_t y) {
+        return heads[x] && (!heads[y] || comp(*heads[x], *heads[y]));
+    };
+
+    // play the initial tournament bottom up: the leaf i is the node (n + i),
+    // the node k has children 2k and 2k + 1; tree[0] is the overall winner
+    size_t n = streams.size();
+    std::vector<size_t> tree(n);
+    std::vector<size_t> winners(2 * n);
+    for (size_t i = 0; i < n; i++) {
+        winners[n + i] = i;
+    }
+    for (size_t k = n - 1; k > 0; k--) {
+        size_t x = winners[2 * k], y = winners[2 * k + 1];
+        if (less(y, x)) {
+            std::swap(x, y);
+        }
+        winners[k] = x;
+        tree[k] = y;
+    }
+    tree[0] = winners[1];
 
+    size_t slast = n, streak = 0;
     for (;;) {
-        if (comp(s1->Front(), s2->Front())) {
-            if (comp(s3->Front(), s4->Front()))
-                smin = comp(s1->Front(), s3->Front()) ? s1 : s3;
-            else
-                smin = comp(s1->Front(), s4->Front()) ? s1 : s4;
+        // output the minimum element
+        size_t smin = tree[0];
+        if (!heads[smin]) {
+            // the winner is a sentinel: all streams are exhausted
+            break;
+        }
+
+        InputStream* s = streams[smin];
+        streak = (smin == slast) ? streak + 1 : 1;
+        slast = smin;
+        size_t srunner = n;
+        if (streak >= MERGE_GALLOP_STREAK) {
+            for (size_t k = (smin + n) / 2; k > 0; k /= 2) {
+                if (srunner == n || less(tree[k], srunner)) {
+                    srunner = tree[k];
+                }
+            }
+            streak = 0;
+        }
+        if (srunner < n && heads[srunner]) {
+            gallop_stream(s, sout, *heads[srunner], comp);
+        } else if (srunner < n) {
+            // no runner-up: the other streams are exhausted
+            auto last = s->FrontEnd();
+            sout->Push(s->FrontBegin(), last);
+            s->Pop(last);
         } else {
-            if (comp(s3->Front(), s4->Front()))
-                smin = comp(s2->Front(), s3->Front()) ? s2 : s3;
-            else
-                smin = comp(s2->Front(), s4->Front()) ? s2 : s4;
+            sout->Push(*heads[smin]);
+            s->Pop();
         }
-        sout->Push(smin->Front());
-        smin->Pop();
-        if (smin->Empty()) {
-            sin.erase(smin);
-            break;
+        if (s->Empty()) {
+            // end of this stream
+            heads[smin] = nullptr;
+            sin.erase(s);
+            if (sin.size() <= MERGE_KSTREAMS_MAX) {
+                break;
+            }
+        } else {
+            heads[smin] = &s->Front();
         }
+
+        // replay the matches on the way from the leaf to the root
+        for (size_t k = (smin + n) / 2; k > 0; k /= 2) {
+            if (less(tree[k], smin)) {
+                std::swap(tree[k], smin);
+            }
+        }
+        tree[0] = smin;
     }
-    merge_3streams(sin, sout, comp);
+    merge_kernel(sin, sout, comp);
 }
 
-template <typename InputStream, typename OutputStream, typename Comparator>
-void merge_nstreams(StreamSet<InputStream*>& sin, OutputStream* sout,
-                    Comparator comp)
+// Output stream adapter collapsing adjacent equal values with a combiner:
+// the last value is held back until a greater one is pushed (or Flush)
+template <typename OutputStream, typename Comparator, typename Combiner>
+class CombineOutput
 {
-    TRACE_FUNC();
-    if (sin.size() <= 4) {
-        LOG_ERR(("Internal error: too few streams for heap-based merge %d")
-                % sin.size());
-        return;
-    }
+  public:
+    using ValueType = typename OutputStream::ValueType;
 
-    InputStream* smin;
+    explicit CombineOutput(OutputStream* sout) : sout_(sout) {}
 
-    std::vector<InputStream*> heap;
-    for (auto& s : sin) {
-        if (!s->Empty()) {
-            heap.push_back(s);
+    void Push(const ValueType& value) {
+        if (has_last_ && !comp_(last_, value)) {
+            combine_(last_, value);
+        } else {
+            if (has_last_) {
+                sout_->Push(last_);
+            }
+            last_ = value;
+            has_last_ = true;
+        }
+    }
+    template <typename InputIterator>
+    void Push(InputIterator first, InputIterator last) {
+        for (; first != last; ++first) {
+            Push(*first);
+        }
+    }
+    void Flush() {
+        if (has_last_) {
+            sout_->Push(last_);
+            has_last_ = false;
         }
     }
-    auto hcomp = [ &comp ] (InputStream*& s1, InputStream*& s2) {
-        return comp(s2->Front(), s1->Front());
-    };
-    std::make_heap(heap.begin(), heap.end(), hcomp);
 
-    while (heap.size() > 4) {
-        // find minimum element in the input streams
-        smin = heap.front();
-        std::pop_heap(heap.begin(), heap.end(), hcomp);
+  private:
+    OutputStream* sout_;
+    ValueType last_;
+    bool has_last_ = false;
+    Comparator comp_;
+    Combiner combine_;
+};
 
-        // output the minumum element
-        sout->Push(smin->Front());
-        smin->Pop();
+// no combiner: the values are passed through as they are
+template <typename OutputStream, typename Comparator>
+class CombineOutput<OutputStream, Comparator, void>
+{
+  public:
+    using ValueType = typename OutputStream::ValueType;
 
-        if (smin->Empty()) {
-            // end of this stream
-            heap.pop_back();
-            sin.erase(smin);
-        } else {
-            // there is more data in the stream,
-            // push it back to the heap
-            heap.back() = smin;
-            std::push_heap(heap.begin(), heap.end(), hcomp);
+    explicit CombineOutput(OutputStream* sout) : sout_(sout) {}
+
+    void Push(const ValueType& value) { sout_->Push(value); }
+    template <typename InputIterator>
+    void Push(InputIterator first, InputIterator last) {
+        sout_->Push(first, last);
+    }
+    void Flush() {}
+
+  private:
+    OutputStream* sout_;
+};
+
+// Output stream adapter passing on only the first limit values (0 = all)
+template <typename OutputStream>
+class LimitOutput
+{
+  public:
+    using ValueType = typename OutputStream::ValueType;
+
+    LimitOutput(OutputStream* sout, size_t limit)
+        : sout_(sout), limit_(limit) {}
+
+    void Push(const ValueType& value) {
+        if (!limit_ || count_ < limit_) {
+            sout_->Push(value);
+            count_++;
+        }
+    }
+    template <typename InputIterator>
+    void Push(InputIterator first, InputIterator last) {
+        size_t n = std::distance(first, last);
+        if (limit_) {
+            n = std::min(n, limit_ - count_);
         }
+        sout_->Push(first, std::next(first, n));
+        count_ += n;
+    }
+
+  private:
+    OutputStream* sout_;
+    size_t limit_;
+    size_t count_ = 0;
+};
+
+// Picks the merge kernel. Numeric values ordered by std::less (uint32_t by
+// default) go to the SIMD merge tree whenever the CPU has SSE4.1/AVX2: on
+// random runs it merges 4 to 8 times faster than the scalar kernels (k = 2
+// to 256), and on runs barely overlapping its nodes gallop (see
+// MergeTreeNode), as the scalar kernels do. The scalar kernels merge
+// everything else: records, other types and comparators, and CPUs without
+// SIMD. They're picked by the number of live streams: merge_kstreams<K>
+// for 2 to MERGE_KSTREAMS_MAX, the generic loser tree (merge_nstreams)
+// above
+template <typename InputStream, typename OutputStream, typename Comparator>
+void merge_kernel(StreamSet<InputStream*>& sin, OutputStream* sout,
+                  Comparator comp)
+{
+    if (sin.size() > 1 &&
+        simd::enabled<typename InputStream::ValueType, Comparator>()) {
+        merge_tree_simd(sin, sout, comp);
+        return;
+    }
+    switch (sin.size()) {
+    case 0:  break;
+    case 1:  copy_stream(*sin.begin(), sout); break;
+    case 2:  merge_kstreams<2>(sin, sout, comp); break;
+    case 3:  merge_kstreams<3>(sin, sout, comp); break;
+    case 4:  merge_kstreams<4>(sin, sout, comp); break;
+    case 5:  merge_kstreams<5>(sin, sout, comp); break;
+    case 6:  merge_kstreams<6>(sin, sout, comp); break;
+    case 7:  merge_kstreams<7>(sin, sout, comp); break;
+    case 8:  merge_kstreams<8>(sin, sout, comp); break;
+    case 9:  merge_kstreams<9>(sin, sout, comp); break;
+    case 10: merge_kstreams<10>(sin, sout, comp); break;
+    case 11: merge_kstreams<11>(sin, sout, comp); break;
+    case 12: merge_kstreams<12>(sin, sout, comp); break;
+    case 13: merge_kstreams<13>(sin, sout, comp); break;
+    case 14: merge_kstreams<14>(sin, sout, comp); break;
+    case 15: merge_kstreams<15>(sin, sout, comp); break;
+    case 16: merge_kstreams<16>(sin, sout, comp); break;
+    default: merge_nstreams(sin, sout, comp); break;
     }
-    merge_4streams(sin, sout, comp);
 }
 
+// merges the streams, collapsing equal values if the ValueType has a Combiner
+template <typename InputStream, typename OutputStream, typename Comparator>
+void merge_combined(StreamSet<InputStream*>& sin, OutputStream* sout,
+                    Comparator comp)
+{
+    // equal values of different streams meet in the output only
+    CombineOutput<OutputStream, Comparator, typename CombinerTraits<
+        typename InputStream::ValueType>::Combiner> cout(sout);
+    merge_kernel(sin, &cout, comp);
+    cout.Flush();
+}
+
+// Merges the input streams into the output stream; if limit is given,
+// only the first limit values (after combining) are output. Returns the
+// output stream, or nullptr if a stream failed
 template <typename InputStreamPtr, typename OutputStreamPtr>
 OutputStreamPtr merge_streams(StreamSet<InputStreamPtr> sin,
-                              OutputStreamPtr sout)
+                              OutputStreamPtr sout, size_t limit = 0)
 {
     TRACE_FUNC();
     // Make a new StreamSet with raw pointers to pass to the merge functions:
@@ -186,27 +671,26 @@ OutputStreamPtr merge_streams(StreamSet<InputStreamPtr> sin,
         }
     }
 
-    if (sinp.size() > 0) {
-        sout->Open();
-        if (sinp.size() > 4) {
-            merge_nstreams(sinp, soutp, comp);
-        } else if (sinp.size() == 4) {
-            merge_4streams(sinp, soutp, comp);
-        } else if (sinp.size() == 3) {
-            merge_3streams(sinp, soutp, comp);
-        } else if (sinp.size() == 2) {
-            merge_2streams(sinp, soutp, comp);
-        } else if (sinp.size() == 1) {
-            copy_stream(*sinp.begin(), soutp);
-        }
-        sout->Close();
+    // (empty inputs make an empty output)
+    sout->Open();
+    if (limit) {
+        LimitOutput<OutputStream> lout(soutp, limit);
+        merge_combined(sinp, &lout, comp);
     } else {
-        LOG_ERR(("No input streams to merge!"));
+        merge_combined(sinp, soutp, comp);
+    }
+    sout->Close();
+    if (sout->output_failed()) {
+        // the output is incomplete
         sout.reset();
     }
 
     for (const auto& s : sin) {
         s->Close();
+        if (s->input_failed()) {
+            // values of the input are lost: the output is incomplete
+            sout.reset();
+        }
     }
     return sout;
 }
@@ -0,0 +1,407 @@
+#ifndef EXTERNAL_SORT_SIMD_HPP
+#define EXTERNAL_SORT_SIMD_HPP
+
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXTERNAL_SORT_SIMD
+#include <immintrin.h>
+#endif
+
+namespace external_sort {
+namespace simd {
+
+// Merges two sorted arrays of numeric values (ordered by std::less) with
+// bitonic merge networks: W values of each array are merged at a time in
+// vector registers (AVX2 or SSE4.1, whichever the CPU supports at runtime).
+// Other types and comparators are merged with std::merge.
+
+// merges the rest of three sorted arrays (scalar)
+template <typename T>
+T* merge_tail(const T* c, const T* ce, const T* a, const T* ae,
+              const T* b, const T* be, T* out)
+{
+    for (;;) {
+        if (c == ce) {
+            return std::merge(a, ae, b, be, out);
+        }
+        if (a == ae) {
+            return std::merge(c, ce, b, be, out);
+        }
+        if (b == be) {
+            return std::merge(c, ce, a, ae, out);
+        }
+        if (*a < *c && *a < *b) {
+            *out++ = *a++;
+        } else if (*b < *c) {
+            *out++ = *b++;
+        } else {
+            *out++ = *c++;
+        }
+    }
+}
+
+#ifdef EXTERNAL_SORT_SIMD
+
+#define ES_AVX2 __attribute__((target("avx2")))
+#define ES_SSE4 __attribute__((target("sse4.1")))
+
+/// ----------------------------------------------------------------------------
+/// AVX2: 8 x 32-bit or 4 x 64-bit values per register
+
+// min/max of vectors of values ordered by std::less; equal values (and
+// NaN) are kept as they are, so no value gets lost or duplicated
+template <typename T> struct Avx2Ops { static const bool enabled = false; };
+
+template <> struct Avx2Ops<uint32_t> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_min_epu32(a, b);
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_max_epu32(a, b);
+    }
+};
+
+template <> struct Avx2Ops<int32_t> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_min_epi32(a, b);
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_max_epi32(a, b);
+    }
+};
+
+template <> struct Avx2Ops<float> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Less(__m256i a, __m256i b) {
+        return _mm256_castps_si256(_mm256_cmp_ps(
+            _mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_LT_OQ));
+    }
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, Less(b, a));
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(b, a, Less(b, a));
+    }
+};
+
+template <> struct Avx2Ops<int64_t> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Less(__m256i a, __m256i b) {
+        return _mm256_cmpgt_epi64(b, a);
+    }
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, Less(b, a));
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(b, a, Less(b, a));
+    }
+};
+
+template <> struct Avx2Ops<uint64_t> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Less(__m256i a, __m256i b) {
+        // unsigned compare = signed compare with the sign bits flipped
+        const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+        return _mm256_cmpgt_epi64(_mm256_xor_si256(b, sign),
+                                  _mm256_xor_si256(a, sign));
+    }
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, Less(b, a));
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(b, a, Less(b, a));
+    }
+};
+
+template <> struct Avx2Ops<double> {
+    static const bool enabled = true;
+    ES_AVX2 static __m256i Less(__m256i a, __m256i b) {
+        return _mm256_castpd_si256(_mm256_cmp_pd(
+            _mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_LT_OQ));
+    }
+    ES_AVX2 static __m256i Min(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, Less(b, a));
+    }
+    ES_AVX2 static __m256i Max(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(b, a, Less(b, a));
+    }
+};
+
+// one level of a bitonic network: v[i] and t[i] are compared, the min goes
+// to the positions of the mask's zero bits, the max to the others
+template <typename Ops, int Mask>
+ES_AVX2 inline __m256i avx2_level(__m256i v, __m256i t)
+{
+    return _mm256_blend_epi32(Ops::Min(v, t), Ops::Max(v, t), Mask);
+}
+
+// merges two sorted vectors: a gets the lower half, b the upper half
+template <typename Ops, size_t Size>
+struct Avx2Network;
+
+template <typename Ops>
+struct Avx2Network<Ops, 4> {
+    static const size_t W = 8;
+
+    ES_AVX2 static __m256i Clean(__m256i v) {
+        v = avx2_level<Ops, 0xF0>(v, _mm256_permute2x128_si256(v, v, 1));
+        v = avx2_level<Ops, 0xCC>(v, _mm256_shuffle_epi32(v, 0x4E));
+        v = avx2_level<Ops, 0xAA>(v, _mm256_shuffle_epi32(v, 0xB1));
+        return v;
+    }
+    ES_AVX2 static void Merge(__m256i& a, __m256i& b) {
+        b = _mm256_permutevar8x32_epi32(
+            b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        __m256i lo = Ops::Min(a, b);
+        __m256i hi = Ops::Max(a, b);
+        a = Clean(lo);
+        b = Clean(hi);
+    }
+};
+
+template <typename Ops>
+struct Avx2Network<Ops, 8> {
+    static const size_t W = 4;
+
+    ES_AVX2 static __m256i Clean(__m256i v) {
+        v = avx2_level<Ops, 0xF0>(v, _mm256_permute4x64_epi64(v, 0x4E));
+        v = avx2_level<Ops, 0xCC>(v, _mm256_shuffle_epi32(v, 0x4E));
+        return v;
+    }
+    ES_AVX2 static void Merge(__m256i& a, __m256i& b) {
+        b = _mm256_permute4x64_epi64(b, 0x1B);
+        __m256i lo = Ops::Min(a, b);
+        __m256i hi = Ops::Max(a, b);
+        a = Clean(lo);
+        b = Clean(hi);
+    }
+};
+
+template <typename T>
+ES_AVX2 T* merge_avx2(const T* a, const T* ae, const T* b, const T* be,
+                      T* out)
+{
+    using Network = Avx2Network<Avx2Ops<T>, sizeof(T)>;
+    const ptrdiff_t W = Network::W;
+    if (ae - a < W || be - b < W) {
+        return std::merge(a, ae, b, be, out);
+    }
+
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+    a += W;
+    b += W;
+    for (;;) {
+        Network::Merge(va, vb);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), va);
+        out += W;
+
+        // the next W values come from the array with the smaller head
+        const T*& next = (a != ae && (b == be || !(*b < *a))) ? a : b;
+        const T* next_end = (&next == &a) ? ae : be;
+        if (next_end - next < W) {
+            break;
+        }
+        va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(next));
+        next += W;
+    }
+
+    // the upper half (sorted) is still to be merged with the rest
+    T carry[Network::W];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(carry), vb);
+    return merge_tail(carry, carry + W, a, ae, b, be, out);
+}
+
+/// ----------------------------------------------------------------------------
+/// SSE4.1: 4 x 32-bit values per register
+
+template <typename T> struct Sse4Ops { static const bool enabled = false; };
+
+template <> struct Sse4Ops<uint32_t> {
+    static const bool enabled = true;
+    ES_SSE4 static __m128i Min(__m128i a, __m128i b) {
+        return _mm_min_epu32(a, b);
+    }
+    ES_SSE4 static __m128i Max(__m128i a, __m128i b) {
+        return _mm_max_epu32(a, b);
+    }
+};
+
+template <> struct Sse4Ops<int32_t> {
+    static const bool enabled = true;
+    ES_SSE4 static __m128i Min(__m128i a, __m128i b) {
+        return _mm_min_epi32(a, b);
+    }
+    ES_SSE4 static __m128i Max(__m128i a, __m128i b) {
+        return _mm_max_epi32(a, b);
+    }
+};
+
+template <> struct Sse4Ops<float> {
+    static const bool enabled = true;
+    ES_SSE4 static __m128i Less(__m128i a, __m128i b) {
+        return _mm_castps_si128(
+            _mm_cmplt_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+    }
+    ES_SSE4 static __m128i Min(__m128i a, __m128i b) {
+        return _mm_blendv_epi8(a, b, Less(b, a));
+    }
+    ES_SSE4 static __m128i Max(__m128i a, __m128i b) {
+        return _mm_blendv_epi8(b, a, Less(b, a));
+    }
+};
+
+template <typename Ops, int Mask>
+ES_SSE4 inline __m128i sse4_level(__m128i v, __m128i t)
+{
+    return _mm_blend_epi16(Ops::Min(v, t), Ops::Max(v, t), Mask);
+}
+
+template <typename Ops>
+struct Sse4Network {
+    static const size_t W = 4;
+
+    ES_SSE4 static __m128i Clean(__m128i v) {
+        v = sse4_level<Ops, 0xF0>(v, _mm_shuffle_epi32(v, 0x4E));
+        v = sse4_level<Ops, 0xCC>(v, _mm_shuffle_epi32(v, 0xB1));
+        return v;
+    }
+    ES_SSE4 static void Merge(__m128i& a, __m128i& b) {
+        b = _mm_shuffle_epi32(b, 0x1B);
+        __m128i lo = Ops::Min(a, b);
+        __m128i hi = Ops::Max(a, b);
+        a = Clean(lo);
+        b = Clean(hi);
+    }
+};
+
+template <typename T>
+ES_SSE4 T* merge_sse4(const T* a, const T* ae, const T* b, const T* be,
+                      T* out)
+{
+    using Network = Sse4Network<Sse4Ops<T>>;
+    const ptrdiff_t W = Network::W;
+    if (ae - a < W || be - b < W) {
+        return std::merge(a, ae, b, be, out);
+    }
+
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+    a += W;
+    b += W;
+    for (;;) {
+        Network::Merge(va, vb);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), va);
+        out += W;
+
+        // the next W values come from the array with the smaller head
+        const T*& next = (a != ae && (b == be || !(*b < *a))) ? a : b;
+        const T* next_end = (&next == &a) ? ae : be;
+        if (next_end - next < W) {
+            break;
+        }
+        va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(next));
+        next += W;
+    }
+
+    // the upper half (sorted) is still to be merged with the rest
+    T carry[Network::W];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(carry), vb);
+    return merge_tail(carry, carry + W, a, ae, b, be, out);
+}
+
+#undef ES_AVX2
+#undef ES_SSE4
+
+/// ----------------------------------------------------------------------------
+/// Runtime dispatch
+
+enum class Isa { NONE, SSE4, AVX2 };
+
+inline Isa cpu_isa()
+{
+    static const Isa isa = __builtin_cpu_supports("avx2")   ? Isa::AVX2 :
+                           __builtin_cpu_supports("sse4.1") ? Isa::SSE4 :
+                                                              Isa::NONE;
+    return isa;
+}
+
+template <typename T, bool = Avx2Ops<T>::enabled>
+struct Avx2Merge {
+    static T* Merge(const T*, const T*, const T*, const T*, T*) {
+        return nullptr;
+    }
+};
+
+template <typename T>
+struct Avx2Merge<T, true> {
+    static T* Merge(const T* a, const T* ae, const T* b, const T* be, T* out) {
+        return merge_avx2(a, ae, b, be, out);
+    }
+};
+
+template <typename T, bool = Sse4Ops<T>::enabled>
+struct Sse4Merge {
+    static T* Merge(const T*, const T*, const T*, const T*, T*) {
+        return nullptr;
+    }
+};
+
+template <typename T>
+struct Sse4Merge<T, true> {
+    static T* Merge(const T* a, const T* ae, const T* b, const T* be, T* out) {
+        return merge_sse4(a, ae, b, be, out);
+    }
+};
+
+//! Returns true if the values can be merged with SIMD on this CPU
+template <typename T, typename Comparator>
+bool enabled()
+{
+    if (!std::is_same<Comparator, std::less<T>>::value) {
+        return false;
+    }
+    return (Avx2Ops<T>::enabled && cpu_isa() == Isa::AVX2) ||
+           (Sse4Ops<T>::enabled && cpu_isa() != Isa::NONE);
+}
+
+//! Merges two sorted arrays into out (SIMD if enabled), returns the end
+template <typename T, typename Comparator>
+T* merge(const T* a, const T* ae, const T* b, const T* be, T* out,
+         Comparator comp)
+{
+    if (enabled<T, Comparator>()) {
+        if (Avx2Ops<T>::enabled && cpu_isa() == Isa::AVX2) {
+            return Avx2Merge<T>::Merge(a, ae, b, be, out);
+        }
+        return Sse4Merge<T>::Merge(a, ae, b, be, out);
+    }
+    return std::merge(a, ae, b, be, out, comp);
+}
+
+#else
+
+template <typename T, typename Comparator>
+bool enabled()
+{
+    return false;
+}
+
+template <typename T, typename Comparator>
+T* merge(const T* a, const T* ae, const T* b, const T* be, T* out,
+         Comparator comp)
+{
+    return std::merge(a, ae, b, be, out, comp);
+}
+
+#endif
+
+} // namespace simd
+} // namespace external_sort
+
+#endif
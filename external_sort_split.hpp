@@ -0,0 +1,632 @@
+#ifndef EXTERNAL_SORT_SPLIT_HPP
+#define EXTERNAL_SORT_SPLIT_HPP
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+#include "async_funcs.hpp"
+
+namespace external_sort {
+
+// blocks smaller than this (per thread) are not worth sorting in parallel
+const size_t PSORT_MIN_CHUNK = 1 << 14;
+
+// buckets smaller than this are not worth another radix pass
+const size_t RADIX_MIN_BUCKET = 64;
+
+/// ----------------------------------------------------------------------------
+/// radix sort
+
+// sorts a range in place by the radix key, starting from the digit
+// at the given shift (MSD radix sort, aka American flag sort)
+template <typename Iterator, typename RadixKey>
+void radix_sort(Iterator first, Iterator last, RadixKey key, size_t shift)
+{
+    using KeyType = typename RadixKey::KeyType;
+    using ValueType = typename std::iterator_traits<Iterator>::value_type;
+    static_assert(std::is_unsigned<KeyType>::value,
+                  "RadixKey::KeyType must be an unsigned integer");
+
+    size_t size = std::distance(first, last);
+
+    if (size < RADIX_MIN_BUCKET) {
+        std::sort(first, last,
+                  [&key] (const ValueType& x, const ValueType& y) {
+                      return key(x) < key(y);
+                  });
+        return;
+    }
+
+    auto digit = [&key, shift] (const ValueType& x) {
+        return static_cast<size_t>((key(x) >> shift) & 0xFF);
+    };
+
+    // count the digits; skip the digit if it's the same everywhere
+    size_t count[256] = {0};
+    for (Iterator it = first; it != last; ++it) {
+        count[digit(*it)]++;
+    }
+    if (count[digit(*first)] == size) {
+        if (shift > 0) {
+            radix_sort(first, last, key, shift - 8);
+        }
+        return;
+    }
+
+    // compute the bucket boundaries
+    Iterator next[256];
+    Iterator end[256];
+    Iterator it = first;
+    for (size_t b = 0; b < 256; b++) {
+        next[b] = it;
+        it += count[b];
+        end[b] = it;
+    }
+
+    // move every value into its bucket (swapping along the cycles)
+    for (size_t b = 0; b < 256; b++) {
+        while (next[b] != end[b]) {
+            auto value = std::move(*next[b]);
+            size_t d = digit(value);
+            while (d != b) {
+                std::swap(value, *next[d]);
+                ++next[d];
+                d = digit(value);
+            }
+            *next[b] = std::move(value);
+            ++next[b];
+        }
+    }
+
+    // sort the buckets by the next digit
+    if (shift > 0) {
+        Iterator bucket = first;
+        for (size_t b = 0; b < 256; b++) {
+            if (count[b] > 1) {
+                radix_sort(bucket, bucket + count[b], key, shift - 8);
+            }
+            bucket += count[b];
+        }
+    }
+}
+
+// sorts a range in place by the radix key
+template <typename Iterator, typename RadixKey>
+void radix_sort(Iterator first, Iterator last, RadixKey key)
+{
+    radix_sort(first, last, key, sizeof(typename RadixKey::KeyType) * 8 - 8);
+}
+
+/// ----------------------------------------------------------------------------
+/// block sorters (kernels sorting one chunk of a block)
+
+// sorts with the comparator
+template <typename Comparator>
+struct ComparisonSorter
+{
+    template <typename Iterator>
+    void operator()(Iterator first, Iterator last) const {
+        std::sort(first, last, comp);
+    }
+    Comparator comp;
+};
+
+// sorts by the radix key
+template <typename RadixKey>
+struct RadixSorter
+{
+    template <typename Iterator>
+    void operator()(Iterator first, Iterator last) const {
+        radix_sort(first, last, key);
+    }
+    RadixKey key;
+};
+
+/// ----------------------------------------------------------------------------
+/// parallel sort
+
+// merges two adjacent sorted ranges through the buffer: the shorter range
+// is moved to the buffer and merged back starting from its own side,
+// so the buffer takes just the size of the shorter range
+template <typename Iterator, typename Comparator, typename Buffer>
+void buffered_merge(Iterator first, Iterator middle, Iterator last,
+                    Comparator comp, Buffer buf)
+{
+    if (middle - first <= last - middle) {
+        Buffer bend = std::move(first, middle, buf);
+        while (buf != bend && middle != last) {
+            *first++ = comp(*middle, *buf) ? std::move(*middle++)
+                                           : std::move(*buf++);
+        }
+        std::move(buf, bend, first);
+    } else {
+        Buffer bend = std::move(middle, last, buf);
+        while (buf != bend && first != middle) {
+            *--last = comp(*(bend - 1), *(middle - 1)) ? std::move(*--middle)
+                                                       : std::move(*--bend);
+        }
+        std::move_backward(buf, bend, last);
+    }
+}
+
+// merges two adjacent sorted ranges in nthreads tasks: the longer range
+// is cut in the middle, its pivot is located in the other range, the inner
+// parts are rotated and two independent merges are left. The buffer takes
+// the size of the shorter range, which is shared by the two merges
+template <typename Iterator, typename Comparator, typename Buffer>
+void parallel_merge(Iterator first, Iterator middle, Iterator last,
+                    Comparator comp, Buffer buf, size_t nthreads,
+                    aux::TaskRunner* runner)
+{
+    if (nthreads <= 1 || first == middle || middle == last) {
+        buffered_merge(first, middle, last, comp, buf);
+        return;
+    }
+
+    Iterator cut1, cut2;
+    if (middle - first > last - middle) {
+        cut1 = first + (middle - first) / 2;
+        cut2 = std::lower_bound(middle, last, *cut1, comp);
+    } else {
+        cut2 = middle + (last - middle) / 2;
+        cut1 = std::upper_bound(first, middle, *cut2, comp);
+    }
+    Iterator pivot = std::rotate(cut1, middle, cut2);
+
+    size_t nthreads1 = nthreads / 2;
+    Buffer buf2 = buf + std::min(cut1 - first, pivot - cut1);
+    std::vector<aux::TaskRunner::Task> tasks = {
+        [=] () { parallel_merge(first, cut1, pivot, comp, buf,
+                                nthreads1, runner); },
+        [=] () { parallel_merge(pivot, cut2, last, comp, buf2,
+                                nthreads - nthreads1, runner); }
+    };
+    runner->RunAll(tasks);
+}
+
+// sorts a range in up to nthreads tasks of the runner (parallel merge sort):
+// the range is cut into chunks sorted independently by the sorter, then
+// the sorted chunks are merged pairwise; all merges of a round run in
+// parallel. The merges take a buffer of half the range (see sort_memory)
+template <typename Iterator, typename Comparator, typename Sorter>
+void parallel_sort(Iterator first, Iterator last, Comparator comp,
+                   size_t nthreads, aux::TaskRunner* runner, Sorter sorter)
+{
+    using ValueType = typename std::iterator_traits<Iterator>::value_type;
+
+    size_t size = std::distance(first, last);
+    nthreads = runner ? std::min(nthreads, size / PSORT_MIN_CHUNK) : 1;
+    if (nthreads <= 1) {
+        sorter(first, last);
+        return;
+    }
+
+    std::vector<Iterator> bounds;
+    for (size_t i = 0; i <= nthreads; i++) {
+        bounds.push_back(first + size * i / nthreads);
+    }
+
+    // sort the chunks
+    std::vector<aux::TaskRunner::Task> tasks;
+    for (size_t i = 0; i < nthreads; i++) {
+        Iterator lo = bounds[i], hi = bounds[i + 1];
+        tasks.push_back([lo, hi, sorter] () { sorter(lo, hi); });
+    }
+    runner->RunAll(tasks);
+
+    // merge the sorted chunks, doubling their size each round; a merge
+    // of the range [lo, hi) takes the buffer from (lo - first) / 2 on
+    std::vector<ValueType> buf(size / 2);
+    for (size_t step = 1; step < nthreads; step *= 2) {
+        tasks.clear();
+        for (size_t i = 0; i + step < nthreads; i += 2 * step) {
+            Iterator lo = bounds[i], mid = bounds[i + step],
+                     hi = bounds[std::min(i + 2 * step, nthreads)];
+            ValueType* lobuf = buf.data() + (lo - first) / 2;
+            tasks.push_back([=] () {
+                parallel_merge(lo, mid, hi, comp, lobuf, 2 * step, runner);
+            });
+        }
+        runner->RunAll(tasks);
+    }
+}
+
+// sorts a range in up to nthreads tasks of the runner and std::sort
+template <typename Iterator, typename Comparator>
+void parallel_sort(Iterator first, Iterator last, Comparator comp,
+                   size_t nthreads, aux::TaskRunner* runner)
+{
+    parallel_sort(first, last, comp, nthreads, runner,
+                  ComparisonSorter<Comparator>{comp});
+}
+
+// memory a parallel sort of a range of ValueType takes besides the range,
+// in bytes per value (the merge buffer)
+template <typename ValueType>
+size_t parallel_sort_memory(size_t nthreads)
+{
+    return nthreads > 1 ? (sizeof(ValueType) + 1) / 2 : 0;
+}
+
+/// ----------------------------------------------------------------------------
+/// indirect sort
+
+// compact (key, index) pair sorted in place of a wide record
+template <typename KeyType, typename IndexType>
+struct KeyIndex
+{
+    KeyType key;
+    IndexType index;
+};
+
+template <typename KeyIndexType>
+struct KeyIndexComparator
+{
+    bool operator()(const KeyIndexType& x, const KeyIndexType& y) const {
+        return x.key < y.key;
+    }
+};
+
+template <typename KeyIndexType, typename RadixKey>
+struct KeyIndexRadixKey
+{
+    using KeyType = typename RadixKey::KeyType;
+    KeyType operator()(const KeyIndexType& x) const { return key(x.key); }
+    RadixKey key;
+};
+
+// sorts the (key, index) pairs: radix sort if the key has a radix key
+template <typename KeyIndexType, typename KeyType>
+void sort_keys(std::vector<KeyIndexType>& keys, size_t nthreads,
+               aux::TaskRunner* runner, std::false_type /* no radix key */)
+{
+    parallel_sort(keys.begin(), keys.end(),
+                  KeyIndexComparator<KeyIndexType>(), nthreads, runner);
+}
+
+template <typename KeyIndexType, typename KeyType>
+void sort_keys(std::vector<KeyIndexType>& keys, size_t nthreads,
+               aux::TaskRunner* runner, std::true_type /* radix key */)
+{
+    using RadixKey = KeyIndexRadixKey<
+        KeyIndexType, typename RadixKeyTraits<KeyType>::RadixKey>;
+    parallel_sort(keys.begin(), keys.end(),
+                  KeyIndexComparator<KeyIndexType>(), nthreads, runner,
+                  RadixSorter<RadixKey>{RadixKey()});
+}
+
+// sorts a range of wide records indirectly: extracts the (key, index)
+// pairs, sorts them and moves every record to its place along the cycles
+// of the permutation (each record is moved exactly once)
+template <typename IndexType, typename Iterator, typename IndirectKey>
+void indirect_sort(Iterator first, Iterator last, IndirectKey key,
+                   size_t nthreads, aux::TaskRunner* runner)
+{
+    using KeyType = typename IndirectKey::KeyType;
+    using KeyIndexType = KeyIndex<KeyType, IndexType>;
+
+    size_t size = std::distance(first, last);
+    std::vector<KeyIndexType> keys;
+    keys.reserve(size);
+    for (size_t i = 0; i < size; i++) {
+        keys.push_back(KeyIndexType{key(first[i]), IndexType(i)});
+    }
+
+    sort_keys<KeyIndexType, KeyType>(keys, nthreads, runner,
+        std::integral_constant<bool, RadixKeyTraits<KeyType>::enabled>());
+
+    // keys[i].index is the position of the record to be moved to i
+    for (size_t i = 0; i < size; i++) {
+        if (keys[i].index == i) {
+            continue;
+        }
+        auto value = std::move(first[i]);
+        size_t j = i;
+        for (;;) {
+            size_t k = keys[j].index;
+            keys[j].index = IndexType(j);
+            if (k == i) {
+                first[j] = std::move(value);
+                break;
+            }
+            first[j] = std::move(first[k]);
+            j = k;
+        }
+    }
+}
+
+/// ----------------------------------------------------------------------------
+/// block sort: picks the kernel according to the ValueTraits
+
+using SortByComparator = std::integral_constant<int, 0>;
+using SortByRadixKey = std::integral_constant<int, 1>;
+using SortByIndirectKey = std::integral_constant<int, 2>;
+
+template <typename ValueType>
+using BlockSortKernel = std::integral_constant<int,
+    IndirectKeyTraits<ValueType>::enabled ? SortByIndirectKey::value :
+    RadixKeyTraits<ValueType>::enabled ? SortByRadixKey::value :
+    SortByComparator::value>;
+
+template <typename ValueType, typename Iterator>
+void sort_block(Iterator first, Iterator last, size_t nthreads,
+                aux::TaskRunner* runner, SortByComparator)
+{
+    parallel_sort(first, last, typename Types<ValueType>::Comparator(),
+                  nthreads, runner);
+}
+
+template <typename ValueType, typename Iterator>
+void sort_block(Iterator first, Iterator last, size_t nthreads,
+                aux::TaskRunner* runner, SortByRadixKey)
+{
+    using RadixKey = typename RadixKeyTraits<ValueType>::RadixKey;
+    parallel_sort(first, last, typename Types<ValueType>::Comparator(),
+                  nthreads, runner, RadixSorter<RadixKey>{RadixKey()});
+}
+
+template <typename ValueType, typename Iterator>
+void sort_block(Iterator first, Iterator last, size_t nthreads,
+                aux::TaskRunner* runner, SortByIndirectKey)
+{
+    using IndirectKey = typename IndirectKeyTraits<ValueType>::IndirectKey;
+    if (size_t(std::distance(first, last)) <=
+        std::numeric_limits<uint32_t>::max()) {
+        indirect_sort<uint32_t>(first, last, IndirectKey(), nthreads, runner);
+    } else {
+        indirect_sort<size_t>(first, last, IndirectKey(), nthreads, runner);
+    }
+}
+
+// sorts a block (range) with the fastest kernel known for the ValueType;
+// nthreads > 1 splits the sort into tasks of the runner (if any)
+template <typename ValueType, typename Iterator>
+void sort_block(Iterator first, Iterator last, size_t nthreads,
+                aux::TaskRunner* runner)
+{
+    sort_block<ValueType>(first, last, nthreads, runner,
+                          BlockSortKernel<ValueType>());
+}
+
+template <typename ValueType>
+size_t sort_block_memory(size_t, size_t nthreads, SortByComparator)
+{
+    return parallel_sort_memory<ValueType>(nthreads);
+}
+
+template <typename ValueType>
+size_t sort_block_memory(size_t, size_t nthreads, SortByRadixKey)
+{
+    return parallel_sort_memory<ValueType>(nthreads);
+}
+
+template <typename KeyIndexType>
+size_t indirect_sort_memory(size_t nthreads)
+{
+    // the (key, index) pairs and their own sort
+    return sizeof(KeyIndexType) + parallel_sort_memory<KeyIndexType>(nthreads);
+}
+
+template <typename ValueType>
+size_t sort_block_memory(size_t size, size_t nthreads, SortByIndirectKey)
+{
+    using KeyType = typename IndirectKeyTraits<ValueType>::IndirectKey::KeyType;
+    if (size <= std::numeric_limits<uint32_t>::max()) {
+        return indirect_sort_memory<KeyIndex<KeyType, uint32_t>>(nthreads);
+    } else {
+        return indirect_sort_memory<KeyIndex<KeyType, size_t>>(nthreads);
+    }
+}
+
+// memory sort_block takes besides a block of the given size (in values),
+// in bytes per value: the blocks are sized to leave room for it
+template <typename ValueType>
+size_t sort_block_memory(size_t size, size_t nthreads)
+{
+    return sort_block_memory<ValueType>(size, nthreads,
+                                        BlockSortKernel<ValueType>());
+}
+
+// the memory for the blocks of a sort out of the given memory: the blocks
+// plus the memory their sort takes (sort_block_memory) fit in it
+template <typename ValueType>
+size_t sort_blocks_memsize(size_t memsize, size_t memblocks, size_t nthreads)
+{
+    size_t extra = sort_block_memory<ValueType>(
+        memsize / std::max<size_t>(memblocks, 1) / sizeof(ValueType), nthreads);
+    return memsize / (sizeof(ValueType) + extra) * sizeof(ValueType);
+}
+
+/// ----------------------------------------------------------------------------
+/// natural runs
+
+// checks if a range is already sorted (linear scan); a range sorted in
+// the reverse order gets reversed. Returns true if the range is sorted now
+template <typename Iterator, typename Comparator>
+bool make_ascending(Iterator first, Iterator last, Comparator comp)
+{
+    using ValueType = typename std::iterator_traits<Iterator>::value_type;
+    if (std::is_sorted(first, last, comp)) {
+        return true;
+    }
+    auto rcomp = [&comp] (const ValueType& x, const ValueType& y) {
+        return comp(y, x);
+    };
+    if (std::is_sorted(first, last, rcomp)) {
+        std::reverse(first, last);
+        return true;
+    }
+    return false;
+}
+
+/// ----------------------------------------------------------------------------
+/// combining equal records
+
+// collapses adjacent equal values of a sorted range into one with the
+// combiner (in place, like std::unique); returns the new end of the range
+template <typename Iterator, typename Comparator, typename Combiner>
+Iterator combine_equal(Iterator first, Iterator last, Comparator comp,
+                       Combiner combine)
+{
+    if (first == last) {
+        return last;
+    }
+    Iterator acc = first;
+    for (Iterator it = first + 1; it != last; ++it) {
+        if (!comp(*acc, *it)) {
+            combine(*acc, *it);
+        } else if (++acc != it) {
+            *acc = std::move(*it);
+        }
+    }
+    return ++acc;
+}
+
+template <typename ValueType, typename Block>
+void combine_block(Block&, std::false_type)
+{
+}
+
+template <typename ValueType, typename Block>
+void combine_block(Block& block, std::true_type)
+{
+    using Combiner = typename CombinerTraits<ValueType>::Combiner;
+    block.erase(combine_equal(block.begin(), block.end(),
+                              typename Types<ValueType>::Comparator(),
+                              Combiner()),
+                block.end());
+}
+
+// collapses equal values of a sorted block (if the ValueType has a Combiner)
+template <typename ValueType, typename Block>
+void combine_block(Block& block)
+{
+    combine_block<ValueType>(block, std::integral_constant<bool,
+                             CombinerTraits<ValueType>::enabled>());
+}
+
+/// ----------------------------------------------------------------------------
+/// replacement selection
+
+// Heap over the values kept in memory while forming runs by replacement
+// selection, which takes no memory besides the values: the front of the
+// values is a binary heap (min-heap) of the current run, the values going
+// to the next run are put aside at its back, so the heap shrinks as they
+// come. When the current run is over, they make the heap of the next run
+template <typename ValueType, typename Comparator,
+          typename Values = std::vector<ValueType>>
+class SelectionHeap
+{
+  public:
+    static const size_t RUN_NONE = std::numeric_limits<size_t>::max();
+
+    // builds the heap over the values; all of them go to the run 0
+    SelectionHeap(Values& values, Comparator comp);
+
+    size_t WinnerRun() const { return heap_ ? run_ : RUN_NONE; }
+    const ValueType& Winner() const { return values_[0]; }
+
+    // replaces the winner with the next input value; the value goes
+    // to the next run if it's smaller than the winner
+    void Replace(const ValueType& value);
+    // removes the winner from the heap (no more input)
+    void Remove();
+
+  private:
+    void SiftDown(size_t hole, ValueType value);
+    void NextRun();
+
+  private:
+    Values& values_;
+    size_t heap_;                       // [0, heap_) - heap of the run
+    size_t size_;                       // [heap_, size_) - the next run
+    size_t run_ = 0;                    // run of the winner
+    Comparator comp_;
+};
+
+template <typename ValueType, typename Comparator, typename Values>
+SelectionHeap<ValueType, Comparator, Values>::SelectionHeap(
+    Values& values, Comparator comp)
+    : values_(values), heap_(0), size_(values.size()), comp_(comp)
+{
+    NextRun();
+    run_ = 0;                           // (the first run is 0)
+}
+
+template <typename ValueType, typename Comparator, typename Values>
+void SelectionHeap<ValueType, Comparator, Values>::Replace(
+    const ValueType& value)
+{
+    if (!comp_(value, values_[0])) {
+        SiftDown(0, value);
+        return;
+    }
+
+    // the value goes to the next run: the last value of the heap takes
+    // the place of the winner, the value takes the place of the last one
+    ValueType last = std::move(values_[heap_ - 1]);
+    values_[--heap_] = value;
+    if (heap_) {
+        SiftDown(0, std::move(last));
+    } else {
+        NextRun();
+    }
+}
+
+template <typename ValueType, typename Comparator, typename Values>
+void SelectionHeap<ValueType, Comparator, Values>::Remove()
+{
+    // the last value of the heap takes the place of the winner,
+    // the last value of the next run takes the place of the last one
+    ValueType last = std::move(values_[heap_ - 1]);
+    if (size_ > heap_) {
+        values_[heap_ - 1] = std::move(values_[size_ - 1]);
+    }
+    heap_--;
+    size_--;
+    if (heap_) {
+        SiftDown(0, std::move(last));
+    } else {
+        NextRun();
+    }
+}
+
+// moves the value down from the hole until its children are not smaller
+template <typename ValueType, typename Comparator, typename Values>
+void SelectionHeap<ValueType, Comparator, Values>::SiftDown(
+    size_t hole, ValueType value)
+{
+    for (size_t child = 2 * hole + 1; child < heap_; child = 2 * hole + 1) {
+        if (child + 1 < heap_ && comp_(values_[child + 1], values_[child])) {
+            child++;
+        }
+        if (!comp_(values_[child], value)) {
+            break;
+        }
+        values_[hole] = std::move(values_[child]);
+        hole = child;
+    }
+    values_[hole] = std::move(value);
+}
+
+// no values of the current run left, the next run becomes current
+template <typename ValueType, typename Comparator, typename Values>
+void SelectionHeap<ValueType, Comparator, Values>::NextRun()
+{
+    if (size_ == 0) {
+        return;
+    }
+    Comparator comp = comp_;
+    std::make_heap(values_.begin(), values_.begin() + size_,
+                   [&comp] (const ValueType& x, const ValueType& y) {
+                       return comp(y, x);
+                   });
+    heap_ = size_;
+    run_++;
+}
+
+} // namespace external_sort
+
+#endif
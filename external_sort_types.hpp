@@ -3,14 +3,27 @@
 
 #include <memory>
 #include <vector>
+#include <functional>
 #include <unordered_set>
+#include <type_traits>
+#include <cstring>
+#include <limits>
 
 #include "block_types.hpp"
 #include "block_input_stream.hpp"
 #include "block_output_stream.hpp"
 #include "block_file_read_policy.hpp"
 #include "block_file_write_policy.hpp"
+#include "block_direct_read_policy.hpp"
+#include "block_direct_write_policy.hpp"
+#include "block_uring_read_policy.hpp"
+#include "block_uring_write_policy.hpp"
+#include "block_mmap_input_stream.hpp"
+#include "block_codec_read_policy.hpp"
+#include "block_codec_write_policy.hpp"
+#include "block_callback_write_policy.hpp"
 #include "block_memory_policy.hpp"
+#include "block_forecast_memory_policy.hpp"
 
 namespace external_sort {
 
@@ -19,11 +32,16 @@ namespace external_sort {
 
 enum MemUnit { MB, KB, B };
 
+// file roles (bit mask) for dropping the files from the page cache
+enum CacheRole { CACHE_INPUT = 1, CACHE_TEMP = 2, CACHE_OUTPUT = 4 };
+
 struct MemParams
 {
     size_t  size   = 10;                // memory size
     MemUnit unit   = MB;                // memory unit
     size_t  blocks = 2;                 // number of blocks memory is divided by
+    size_t  drop   = 0;                 // files dropped from the page cache
+                                        // as they're read/written (CacheRole)
 };
 
 struct ErrParams
@@ -45,9 +63,28 @@ struct SplitParams
         std::string ifile;              // input file to split
         std::string ofile;              // output file prefix (prefix of splits)
         bool rm_input = false;          // ifile should be removed when done?
+        size_t ioffset = 0;             // offset of the ifile part to split
+        size_t isize = 0;               // size of the part (0 = up to the end)
+        size_t readers = 1;             // number of parallel input readers
+        size_t workers = 0;             // number of threads sorting blocks
+                                        // (0 = number of hardware threads)
+        size_t threads = 1;             // number of tasks sorting a block
+        bool rsel = false;              // form runs by replacement selection?
+        bool natural = true;            // detect already sorted blocks/runs?
+        bool encode = false;            // encode the runs (integer values)?
+                                        // sort() does, as mrg.encode says
+        bool raw_first = false;         // but write the first run raw? if
+                                        // it's the only one, the merge just
+                                        // renames it (sort() does)
+        size_t limit = 0;               // max number of values per run, only
+                                        // the smallest are kept (0 = all)
     } spl;
     struct {
         std::list<std::string> ofiles;  // list of output files (splits)
+        std::unordered_set<std::string> oencoded;  // the ones written encoded
+        std::function<void(const std::string&, bool)> ready;  // optional,
+                                        // called for each output file when
+                                        // it's done (and if it's encoded)
     } out;
 };
 
@@ -59,10 +96,29 @@ struct MergeParams
         size_t merges    = 4;           // number of simultaneous merges
         size_t kmerge    = 4;           // number of streams to merge at a time
         size_t stmblocks = 2;           // number of memory blocks per stream
+                                        // (the input streams share as many
+                                        // read-ahead blocks, merge_pool_blocks)
+        size_t parts     = 1;           // number of key ranges merged in
+                                        // parallel by the final merge
+        bool plan        = false;       // choose merges, kmerge and stmblocks
+                                        // from the input files, memory and
+                                        // hardware threads automatically
+        size_t ioblock   = 64 << 10;    // min size of a stream block (plan)
+        bool overlap     = false;       // sort(): merge runs in the background
+                                        // while the split is still running
+        size_t limit     = 0;           // max number of values per merge output,
+                                        // only the smallest are kept (0 = all)
         std::list<std::string> ifiles;  // list of input files to merge
         std::string tfile;              // prefix for temporary files
         std::string ofile;              // output file (the merge result)
         bool rm_input = true;           // ifile should be removed when done?
+        bool encode = true;             // encode intermediate files (integer
+                                        // values)? only if parts = 1
+        std::unordered_set<std::string> iencoded;  // ifiles that are encoded
+                                        // runs (split() lists them in
+                                        // out.oencoded)
+        bool tmp_ofile = false;         // ofile is a temporary file itself
+                                        // (merged further, e.g. early merge)
     } mrg;
 };
 
@@ -117,6 +173,52 @@ struct DefaultValue2Str
     }
 };
 
+//! Default radix key (none, the type cannot be radix sorted)
+template <typename T, typename Enable = void>
+struct DefaultRadixKey
+{
+};
+
+//! Default radix key for unsigned integers: the value itself
+template <typename T>
+struct DefaultRadixKey<T, typename std::enable_if<
+                              std::is_integral<T>::value &&
+                              std::is_unsigned<T>::value>::type>
+{
+    using KeyType = T;
+    KeyType operator()(const T& value) const { return value; }
+};
+
+//! Default radix key for signed integers: the sign bit flipped
+template <typename T>
+struct DefaultRadixKey<T, typename std::enable_if<
+                              std::is_integral<T>::value &&
+                              std::is_signed<T>::value>::type>
+{
+    using KeyType = typename std::make_unsigned<T>::type;
+    KeyType operator()(const T& value) const {
+        return KeyType(value) ^ (KeyType(1) << (sizeof(T) * 8 - 1));
+    }
+};
+
+//! Default radix key for IEEE floats: the sign bit flipped for positive
+//! values, all bits flipped for negative ones
+template <typename T>
+struct DefaultRadixKey<T, typename std::enable_if<
+                              std::is_floating_point<T>::value &&
+                              std::numeric_limits<T>::is_iec559 &&
+                              (sizeof(T) == 4 || sizeof(T) == 8)>::type>
+{
+    using KeyType = typename std::conditional<sizeof(T) == 4,
+                                              uint32_t, uint64_t>::type;
+    KeyType operator()(const T& value) const {
+        KeyType bits;
+        memcpy(&bits, &value, sizeof(bits));
+        const KeyType sign = KeyType(1) << (sizeof(T) * 8 - 1);
+        return (bits & sign) ? ~bits : (bits | sign);
+    }
+};
+
 //! Default ValueType traits
 template <typename ValueType>
 struct ValueTraits
@@ -125,16 +227,113 @@ struct ValueTraits
     using Generator = DefaultValueGenerator<ValueType>;
     using Value2Str = DefaultValue2Str<ValueType>;
 
+    // Radix key extractor: maps a value to an unsigned integer (KeyType),
+    // such that the integer order is the same as the Comparator order.
+    // If the traits have no RadixKey (or it has no KeyType), blocks are
+    // sorted with the Comparator
+    using RadixKey = DefaultRadixKey<ValueType>;
+
+    // Optional indirect key extractor for wide records: maps a value to
+    // a compact KeyType ordered by operator< the same way as the Comparator.
+    // If declared, blocks are sorted as arrays of (key, index) pairs and
+    // then permuted, so that the records are moved only once:
+    // using IndirectKey = ...;
+
+    // Optional combiner of records with equal keys (neither is less than
+    // the other by the Comparator): void operator()(ValueType& acc,
+    // const ValueType& value) folds value into acc, e.g. keeps acc as is
+    // (dedup), sums counters or ORs flags. If declared, adjacent equal
+    // records are collapsed into one when runs are written and merged:
+    // using Combiner = ...;
+
     // It can be extended to support non-POD types:
     // static const size_t ValueSize = sizeof(ValueType);
     // static inline int Serialize(...);
     // static inline int Deserialize(...);
 };
 
+//! Helper to detect optional members of the traits
+template <typename... T>
+struct VoidType
+{
+    using type = void;
+};
+
+//! Radix key of the ValueType (if the traits declare one)
+template <typename ValueType, typename Enable = void>
+struct RadixKeyTraits
+{
+    static const bool enabled = false;
+};
+
+template <typename ValueType>
+struct RadixKeyTraits<ValueType, typename VoidType<
+    typename ValueTraits<ValueType>::RadixKey::KeyType>::type>
+{
+    static const bool enabled = true;
+    using RadixKey = typename ValueTraits<ValueType>::RadixKey;
+    using KeyType = typename RadixKey::KeyType;
+};
+
+//! Indirect sort key of the ValueType (if the traits declare one)
+template <typename ValueType, typename Enable = void>
+struct IndirectKeyTraits
+{
+    static const bool enabled = false;
+};
+
+template <typename ValueType>
+struct IndirectKeyTraits<ValueType, typename VoidType<
+    typename ValueTraits<ValueType>::IndirectKey::KeyType>::type>
+{
+    static const bool enabled = true;
+    using IndirectKey = typename ValueTraits<ValueType>::IndirectKey;
+    using KeyType = typename IndirectKey::KeyType;
+};
+
+//! Combiner of the ValueType (if the traits declare one)
+template <typename ValueType, typename Enable = void>
+struct CombinerTraits
+{
+    static const bool enabled = false;
+    using Combiner = void;
+};
+
+template <typename ValueType>
+struct CombinerTraits<ValueType, typename VoidType<
+    typename ValueTraits<ValueType>::Combiner>::type>
+{
+    static const bool enabled = true;
+    using Combiner = typename ValueTraits<ValueType>::Combiner;
+};
+
 //! Stream set
 template <typename T>
 using StreamSet = std::unordered_set<T>;
 
+//! File i/o of the streams: buffered (default), direct (O_DIRECT) or
+//! io_uring (O_DIRECT, many requests in flight), selected at build time
+//! with -DEXTERNAL_SORT_DIRECT_IO or -DEXTERNAL_SORT_URING
+#ifdef EXTERNAL_SORT_DIRECT_IO
+const bool DIRECT_IO = true;
+#else
+const bool DIRECT_IO = false;
+#endif
+
+#ifdef EXTERNAL_SORT_URING
+const bool URING_IO = true;
+#else
+const bool URING_IO = false;
+#endif
+
+//! The runs merged can be read in place through a memory mapping instead
+//! (-DEXTERNAL_SORT_MMAP), the rest of i/o stays as selected above
+#ifdef EXTERNAL_SORT_MMAP
+const bool MMAP_IO = true;
+#else
+const bool MMAP_IO = false;
+#endif
+
 //! All types in one place
 template <typename ValueType>
 struct Types
@@ -142,23 +341,70 @@ struct Types
     // Value trait shortcuts
     using Comparator = typename ValueTraits<ValueType>::Comparator;
 
-    // Block Types
-    using Block = block::VectorBlock<ValueType>;
+    // Block Types (direct i/o reads and writes aligned blocks)
+    using Block = typename std::conditional<DIRECT_IO || URING_IO,
+                                            block::DirectBlock<ValueType>,
+                                            block::VectorBlock<ValueType>>::type;
     using BlockPtr = typename block::BlockTraits<Block>::BlockPtr;
     using BlockPool = typename block::BlockMemoryPolicy<Block>::BlockPool;
     using BlockTraits = block::BlockTraits<Block>;
 
-    // Stream Types
+    // File Policies
+    using FileReadPolicy =
+        typename std::conditional<URING_IO, block::BlockUringReadPolicy<Block>,
+        typename std::conditional<DIRECT_IO, block::BlockDirectReadPolicy<Block>,
+        block::BlockFileReadPolicy<Block>>::type>::type;
+    using FileWritePolicy =
+        typename std::conditional<URING_IO, block::BlockUringWritePolicy<Block>,
+        typename std::conditional<DIRECT_IO, block::BlockDirectWritePolicy<Block>,
+        block::BlockFileWritePolicy<Block>>::type>::type;
+
+    // Temporary runs of integers are encoded (see BlockCodec) with buffered
+    // i/o (the codec reads and writes frames of any size)
+    static const bool ENCODED = block::BlockCodec<ValueType>::supported &&
+                                !DIRECT_IO && !URING_IO && !MMAP_IO;
+    using ReadPolicy = block::BlockCodecReadPolicy<Block, FileReadPolicy,
+                                                   ENCODED>;
+    using WritePolicy = block::BlockCodecWritePolicy<Block, FileWritePolicy,
+                                                     ENCODED>;
+
+    // Stream Types (the input of split/check is the user's file, read as
+    // it is; a run written by the library is read by RStream/MStream,
+    // decoded if set to be encoded)
     using IStream = block::BlockInputStream<Block,
-                                            block::BlockFileReadPolicy<Block>,
+                                            FileReadPolicy,
+                                            block::BlockMemoryPolicy<Block>>;
+
+    using RStream = block::BlockInputStream<Block,
+                                            ReadPolicy,
                                             block::BlockMemoryPolicy<Block>>;
 
     using OStream = block::BlockOutputStream<Block,
-                                             block::BlockFileWritePolicy<Block>,
+                                             WritePolicy,
                                              block::BlockMemoryPolicy<Block>>;
 
+    // Input stream of a merge: shares read-ahead blocks with the other
+    // inputs, or views the mapped run in place
+    using MStream = typename std::conditional<MMAP_IO,
+        block::BlockMmapInputStream<Block>,
+        block::BlockInputStream<Block, ReadPolicy,
+            block::BlockForecastMemoryPolicy<Block, Comparator>>>::type;
+    using MStreamPool = typename std::conditional<MMAP_IO,
+        typename block::BlockMmapInputStream<Block>::BlockPool,
+        typename block::BlockForecastMemoryPolicy<
+            Block, Comparator>::BlockPool>::type;
+
+    // Output stream handing the values over to a user callback (sink)
+    using CStream = block::BlockOutputStream<Block,
+                        block::BlockCallbackWritePolicy<Block>,
+                        block::BlockMemoryPolicy<Block>>;
+    using Sink = typename block::BlockCallbackWritePolicy<Block>::Callback;
+
     using IStreamPtr = std::shared_ptr<IStream>;
+    using RStreamPtr = std::shared_ptr<RStream>;
     using OStreamPtr = std::shared_ptr<OStream>;
+    using MStreamPtr = std::shared_ptr<MStream>;
+    using CStreamPtr = std::shared_ptr<CStream>;
 };
 
 } // namespace external_sort